@@ -6,12 +6,27 @@ LOCAL_SRC_FILES := \
     src/AndroidDesktop.cpp \
     src/AndroidPixelBuffer.cpp \
     src/AndroidSocket.cpp \
+    src/ChurnTracker.cpp \
+    src/CompareCopy.cpp \
+    src/FrameCapture.cpp \
+    src/FrameMetadata.cpp \
+    src/FramePacer.cpp \
+    src/FrameTrace.cpp \
     src/InputDevice.cpp \
+    src/InputQueue.cpp \
+    src/PerfStats.cpp \
+    src/ScrollDetector.cpp \
+    src/TileDiff.cpp \
+    src/TileMatcher.cpp \
     src/VirtualDisplay.cpp \
+    src/WorkerPool.cpp \
     src/main.cpp
 
-#LOCAL_SRC_FILES += \
-#    aidl/org/chemlab/IVNCService.aidl
+LOCAL_SRC_FILES += \
+    aidl/org/chemlab/IVNCService.aidl
+
+LOCAL_AIDL_INCLUDES := \
+    $(LOCAL_PATH)/aidl
 
 LOCAL_C_INCLUDES += \
     $(LOCAL_PATH)/src \
@@ -52,3 +67,38 @@ endif
 LOCAL_VENDOR_MODULE := true
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+# replays traces recorded with -recordtrace, see bench/vncflinger_bench.cpp
+LOCAL_SRC_FILES := \
+    bench/vncflinger_bench.cpp \
+    src/AndroidPixelBuffer.cpp \
+    src/CompareCopy.cpp \
+    src/FrameTrace.cpp \
+    src/TileDiff.cpp \
+    src/WorkerPool.cpp
+
+LOCAL_C_INCLUDES += \
+    $(LOCAL_PATH)/src \
+    external/tigervnc/common \
+
+LOCAL_SHARED_LIBRARIES := \
+    libjpeg \
+    liblog \
+    libui \
+    libutils \
+    libz
+
+LOCAL_STATIC_LIBRARIES += \
+    libtigervnc
+
+LOCAL_CFLAGS := -Ofast -Werror -std=c++14 -fexceptions
+
+LOCAL_MODULE := vncflinger_bench
+
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_VENDOR_MODULE := true
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,317 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Replays a trace recorded with -recordtrace through the capture and
+// encode stages, without SurfaceFlinger or a network connection:
+//
+//   vncflinger_bench <trace> [-tilesize n] [-threads n] [-zliblevel n]
+//                            [-jpegquality n] [-subsampling n] [-loops n]
+
+#define LOG_TAG "VNCFlinger-Bench"
+#include <utils/Log.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <utils/Timers.h>
+
+#include <ui/DisplayInfo.h>
+
+#include <rdr/MemOutStream.h>
+#include <rdr/ZlibOutStream.h>
+#include <rfb/JpegCompressor.h>
+#include <rfb/Rect.h>
+#include <rfb/Region.h>
+
+#include "AndroidPixelBuffer.h"
+#include "CompareCopy.h"
+#include "FrameTrace.h"
+#include "TileDiff.h"
+#include "WorkerPool.h"
+
+using namespace vncflinger;
+using namespace android;
+
+namespace {
+
+struct Options {
+    Options()
+        : tileSize(TileDiff::kDefaultTileSize),
+          threads(1),
+          zlibLevel(1),
+          jpegQuality(80),
+          subsampling(0),
+          loops(1) {
+    }
+
+    const char* trace;
+    int tileSize;
+    int threads;
+    int zlibLevel;
+    int jpegQuality;
+    int subsampling;
+    int loops;
+};
+
+// per frame durations of one stage
+class Samples {
+  public:
+    void add(nsecs_t duration) {
+        mSamples.push_back(duration);
+        mTotal += duration;
+    }
+
+    nsecs_t total() const {
+        return mTotal;
+    }
+
+    void print(const char* name) {
+        if (mSamples.empty()) {
+            printf("  %-12s no samples\n", name);
+            return;
+        }
+        std::sort(mSamples.begin(), mSamples.end());
+        printf("  %-12s avg=%6" PRId64 "us p50=%6" PRId64 "us p90=%6" PRId64 "us p99=%6" PRId64
+               "us max=%6" PRId64 "us\n",
+               name, ns2us(mTotal / (nsecs_t)mSamples.size()), ns2us(percentile(0.5)),
+               ns2us(percentile(0.9)), ns2us(percentile(0.99)), ns2us(mSamples.back()));
+    }
+
+  private:
+    nsecs_t percentile(double fraction) const {
+        size_t i = std::min(mSamples.size() - 1, (size_t)(mSamples.size() * fraction));
+        return mSamples[i];
+    }
+
+    std::vector<nsecs_t> mSamples;
+    nsecs_t mTotal = 0;
+};
+
+nsecs_t cpuTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return s2ns(ts.tv_sec) + ts.tv_nsec;
+}
+
+nsecs_t now() {
+    return systemTime(SYSTEM_TIME_MONOTONIC);
+}
+
+void usage(const char* name) {
+    fprintf(stderr,
+            "Usage: %s <trace> [-tilesize n] [-threads n] [-zliblevel n] [-jpegquality n]"
+            " [-subsampling n] [-loops n]\n",
+            name);
+    exit(1);
+}
+
+bool parseOptions(int argc, char** argv, Options* options) {
+    if (argc < 2) {
+        return false;
+    }
+    options->trace = argv[1];
+
+    for (int i = 2; i + 1 < argc; i += 2) {
+        int value = atoi(argv[i + 1]);
+        if (!strcmp(argv[i], "-tilesize")) {
+            options->tileSize = value;
+        } else if (!strcmp(argv[i], "-threads")) {
+            options->threads = std::max(1, value);
+        } else if (!strcmp(argv[i], "-zliblevel")) {
+            options->zlibLevel = value;
+        } else if (!strcmp(argv[i], "-jpegquality")) {
+            options->jpegQuality = value;
+        } else if (!strcmp(argv[i], "-subsampling")) {
+            options->subsampling = value;
+        } else if (!strcmp(argv[i], "-loops")) {
+            options->loops = std::max(1, value);
+        } else {
+            return false;
+        }
+    }
+    return argc % 2 == 0;
+}
+};
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, &options)) {
+        usage(argv[0]);
+    }
+
+    sp<AndroidPixelBuffer> pixels = new AndroidPixelBuffer();
+
+    TileDiff diff;
+    diff.setTileSize(options.tileSize);
+    if (options.threads > 1) {
+        diff.setWorkerPool(new WorkerPool(options.threads, 0));
+    }
+
+    rdr::MemOutStream zlibOut;
+    rdr::ZlibOutStream zlib(&zlibOut, 0, options.zlibLevel);
+    rfb::JpegCompressor jpeg;
+
+    Samples copyTime, presentTime, zlibTime, jpegTime;
+    uint64_t frames = 0, skipped = 0, inputEvents = 0;
+    uint64_t rawBytes = 0, zlibBytes = 0, jpegBytes = 0;
+    nsecs_t firstInput = 0, lastInput = 0;
+
+    nsecs_t cpuStart = cpuTime();
+
+    for (int loop = 0; loop < options.loops; loop++) {
+        FrameTraceReader reader;
+        if (reader.open(options.trace) != NO_ERROR) {
+            fprintf(stderr, "Can't read %s\n", options.trace);
+            return 1;
+        }
+
+        FrameTraceRecord record;
+        while (reader.next(&record)) {
+            if (record.type != FrameTraceRecord::FRAME) {
+                // input is only counted, injecting it needs a device
+                if (firstInput == 0) {
+                    firstInput = record.timestamp;
+                }
+                lastInput = record.timestamp;
+                inputEvents++;
+                continue;
+            }
+
+            if (pixels->getBufferFormat() != record.format) {
+                pixels->setBufferFormat(record.format);
+            }
+            if ((uint32_t)pixels->width() != record.width ||
+                (uint32_t)pixels->height() != record.height) {
+                DisplayInfo info = DisplayInfo();
+                info.w = record.width;
+                info.h = record.height;
+                info.orientation = DISPLAY_ORIENTATION_0;
+                pixels->setDisplayInfo(&info);
+            }
+
+            int bpp = bytesPerPixel(record.format);
+
+            // the same steps as FrameCapture::captureLocked, on a full frame
+            nsecs_t start = now();
+
+            AndroidPixelBuffer::BackBuffer back;
+            if (!pixels->lockBackBuffer(&back)) {
+                skipped++;
+                continue;
+            }
+
+            rfb::Rect bufRect =
+                rfb::Rect(0, 0, record.width, record.height).intersect(back.bounds);
+            rfb::Region diffRegion = back.stale.intersect(rfb::Region(bufRect));
+            diffRegion.assign_union(rfb::Region(bufRect));
+
+            std::vector<rfb::Rect> rects;
+            diffRegion.get_rects(&rects);
+
+            rfb::Region changed;
+            for (const rfb::Rect& r : rects) {
+                diff.process(r, back.data, back.stride, record.pixels.data(), record.width, bpp,
+                             &changed);
+            }
+            pixels->unlockBackBuffer(changed, record.frameNumber);
+
+            copyTime.add(now() - start);
+
+            start = now();
+            rfb::Region damage;
+            uint64_t frameNumber;
+            bool ready = pixels->swapBuffers(&damage, &frameNumber);
+            presentTime.add(now() - start);
+
+            frames++;
+            if (!ready) {
+                continue;
+            }
+
+            damage.get_rects(&rects);
+
+            const rfb::PixelFormat& pf = pixels->getPF();
+
+            start = now();
+            for (const rfb::Rect& r : rects) {
+                int stride;
+                const rdr::U8* buf = pixels->getBuffer(r, &stride);
+                size_t rowLen = r.width() * (pf.bpp / 8);
+                for (int y = 0; y < r.height(); y++) {
+                    zlib.writeBytes(buf + y * stride * (pf.bpp / 8), rowLen);
+                }
+                rawBytes += rowLen * r.height();
+            }
+            zlib.flush();
+            zlibTime.add(now() - start);
+            zlibBytes += zlibOut.length();
+            zlibOut.clear();
+
+            start = now();
+            for (const rfb::Rect& r : rects) {
+                int stride;
+                const rdr::U8* buf = pixels->getBuffer(r, &stride);
+                jpeg.compress(buf, stride, r, pf, options.jpegQuality, options.subsampling);
+                jpegBytes += jpeg.length();
+            }
+            jpegTime.add(now() - start);
+        }
+    }
+
+    nsecs_t cpu = cpuTime() - cpuStart;
+    nsecs_t pipeline =
+        copyTime.total() + presentTime.total() + zlibTime.total() + jpegTime.total();
+
+    printf("%s: %" PRIu64 " frames (%" PRIu64 " skipped), kernel %s, tile size %d, %d threads\n",
+           options.trace, frames, skipped, CompareCopy::getName(), diff.getTileSize(),
+           options.threads);
+    if (frames == 0) {
+        return 0;
+    }
+
+    printf("  fps          %.1f (capture and present only: %.1f)\n",
+           pipeline ? frames * 1e9 / pipeline : 0.0,
+           copyTime.total() + presentTime.total()
+               ? frames * 1e9 / (copyTime.total() + presentTime.total())
+               : 0.0);
+    printf("  cpu time     %" PRId64 "ms (%.1f%% of pipeline)\n", ns2ms(cpu),
+           pipeline ? 100.0 * cpu / pipeline : 0.0);
+
+    copyTime.print("copy+diff");
+    presentTime.print("present");
+    zlibTime.print("zlib");
+    jpegTime.print("jpeg");
+
+    printf("  bytes/frame  raw=%" PRIu64 " zlib(%d)=%" PRIu64 " jpeg(q%d)=%" PRIu64 "\n",
+           rawBytes / frames, options.zlibLevel, zlibBytes / frames, options.jpegQuality,
+           jpegBytes / frames);
+
+    if (inputEvents > 0) {
+        double seconds = (lastInput - firstInput) / 1e9;
+        uint64_t events = inputEvents / options.loops;
+        printf("  input        %" PRIu64 " events (%.1f/s as recorded)\n", events,
+               seconds > 0 ? events / seconds : 0.0);
+    }
+
+    return 0;
+}
@@ -1,30 +1,92 @@
 #define LOG_TAG "AndroidDesktop"
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
 #include <utils/Log.h>
+#include <utils/Trace.h>
 
 #include <fcntl.h>
 #include <inttypes.h>
+#include <stdlib.h>
 #include <sys/eventfd.h>
 
+#include <algorithm>
+
+#include <utils/String8.h>
+#include <utils/Timers.h>
+
 #include <gui/ISurfaceComposer.h>
 #include <gui/SurfaceComposerClient.h>
 
 #include <ui/DisplayInfo.h>
 
+#include <rfb/Configuration.h>
 #include <rfb/PixelFormat.h>
 #include <rfb/Rect.h>
+#include <rfb/Region.h>
 #include <rfb/ScreenSet.h>
 
 #include "AndroidDesktop.h"
 #include "AndroidPixelBuffer.h"
+#include "CompareCopy.h"
+#include "FrameCapture.h"
+#include "FrameTrace.h"
 #include "InputDevice.h"
+#include "InputQueue.h"
+#include "PerfStats.h"
 #include "VirtualDisplay.h"
 
 using namespace vncflinger;
 using namespace android;
 
-AndroidDesktop::AndroidDesktop() {
-    mInputDevice = new InputDevice();
+static rfb::StringParameter recordTrace("recordtrace",
+                                        "File to record frames and input into for replay", "");
+
+static rfb::IntParameter videoRate(
+    "videorate", "Updates per second for areas which change every frame, 0 to send every frame",
+    0);
+
+static rfb::IntParameter displayNumber(
+    "display", "Built-in display to capture, 0 for the main display and 1 for HDMI", 0);
+
+static rfb::IntParameter layerStack(
+    "layerstack", "Layer stack composited into the capture, -1 for the one of the display", -1);
+
+static rfb::IntParameter captureScale(
+    "capturescale", "Size of the framebuffer in percent of the display, unless clients resize it",
+    100);
+
+static rfb::IntParameter idleTimeout(
+    "idletimeout", "Milliseconds to keep the virtual display after the last client leaves", 0);
+
+static rfb::StringParameter screenStatePath(
+    "screenstatepath",
+    "File which reads 0 while the display is off (e.g. the backlight brightness), "
+    "capture pauses then",
+    "");
+
+// rotation is rare, no need to ask surfaceflinger on every frame
+static const int kDisplayPollInterval = 250;
+
+AndroidDesktop::AndroidDesktop()
+    : mDisplayInfoValid(false),
+      mDisplayTimer(this),
+      mIdleTimer(this),
+      mScreenOff(false),
+      mStartTime(0),
+      mVideoTimer(this) {
+    // one device per served display
+    if (displayNumber != 0) {
+        String8 name = String8::format("VNC-RemoteInput-%d", (int)displayNumber);
+        mInputDevice = new InputDevice(name.string());
+    } else {
+        mInputDevice = new InputDevice();
+    }
+    mInputQueue = new InputQueue(mInputDevice);
+    mInputQueue->run("VNC-Input");
     mDisplayRect = Rect(0, 0);
+    mFormatMismatch = false;
+    mParametersChanged = false;
+    mCaptureFormat = PIXEL_FORMAT_RGBX_8888;
+    mCaptureScale = 100;
 
     mEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
     if (mEventFd < 0) {
@@ -34,23 +96,56 @@ AndroidDesktop::AndroidDesktop() {
 }
 
 AndroidDesktop::~AndroidDesktop() {
+    mInputQueue->stop();
     mInputDevice->stop();
     close(mEventFd);
 }
 
 void AndroidDesktop::start(rfb::VNCServer* vs) {
-    mMainDpy = SurfaceComposerClient::getBuiltInDisplay(ISurfaceComposer::eDisplayIdMain);
+    mDpy = SurfaceComposerClient::getBuiltInDisplay(displayNumber);
 
     mServer = vs;
+    mStartTime = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    {
+        Mutex::Autolock _v(mViewportLock);
+        mViewport = mPendingViewport;
+    }
+
+    // reuse the display which is still around from the last session
+    mIdleTimer.stop();
 
     mPixels = new AndroidPixelBuffer();
     mPixels->setDimensionsChangedListener(this);
 
+    // one trace covers every session of this process
+    const char* tracePath = recordTrace;
+    if (mTrace == nullptr && tracePath[0] != '\0') {
+        mTrace.reset(new FrameTraceWriter());
+        if (mTrace->open(tracePath) != NO_ERROR) {
+            mTrace.reset();
+        }
+    }
+
+    mCapture = new FrameCapture(mPixels, &mPacer, this);
+    mCapture->setTraceWriter(mTrace.get());
+    mCapture->run("VNC-Capture");
+
+    mDisplayInfoValid = false;
+    mDisplayTimer.start(kDisplayPollInterval);
+    updateScreenState();
+
     if (updateDisplayInfo() != NO_ERROR) {
         ALOGE("Failed to query display!");
         return;
     }
 
+    mCaptureFormat = mPixels->getBufferFormat();
+    mCaptureScale = 100;
+    applyParameters();
+
+    ALOGI("Frame ingestion kernel: %s", CompareCopy::getName());
+
     ALOGV("Desktop is running");
 }
 
@@ -59,42 +154,93 @@ void AndroidDesktop::stop() {
 
     ALOGV("Shutting down");
 
+    mDisplayTimer.stop();
+    mVideoTimer.stop();
+    mDeferred.clear();
+    mChurn.reset();
+
     mServer->setPixelBuffer(0);
 
-    mVirtualDisplay.clear();
+    mCapture->setConsumer(nullptr);
+    if (idleTimeout > 0 && mVirtualDisplay != nullptr) {
+        mVirtualDisplay->setPaused(true);
+        mIdleTimer.start(idleTimeout);
+    } else {
+        mVirtualDisplay.clear();
+    }
+
+    mCapture->stop();
+    mCapture.clear();
+
     mPixels.clear();
 }
 
 void AndroidDesktop::processFrames() {
+    ATRACE_CALL();
+    PerfStats::ScopedTimer timer(PerfStats::PRESENT);
+
     Mutex::Autolock _l(mLock);
 
-    updateDisplayInfo();
+    // woken up by the binder service while no session is running
+    if (mPixels == nullptr) {
+        return;
+    }
+
+    if (mParametersChanged.exchange(false)) {
+        applyParameters();
+    }
+
+    // gpu couldn't render the low depth format, fall back to rgbx
+    if (mFormatMismatch.exchange(false)) {
+        mPixels->setBufferFormat(PIXEL_FORMAT_RGBX_8888);
+    }
 
-    // get a frame from the virtual display
-    CpuConsumer::LockedBuffer imgBuffer;
-    status_t res = mVirtualDisplay->getConsumer()->lockNextBuffer(&imgBuffer);
-    if (res != OK) {
-        ALOGE("Failed to lock next buffer: %s (%d)", strerror(-res), res);
+    // the capture thread already did the expensive part
+    rfb::Region changed, copied;
+    rfb::Point delta;
+    if (!mPixels->swapBuffers(&changed, &mFrameNumber, &copied, &delta)) {
         return;
     }
 
-    mFrameNumber = imgBuffer.frameNumber;
-    ALOGV("processFrame: [%" PRIu64 "] format: %x (%dx%d, stride=%d)", mFrameNumber, imgBuffer.format,
-          imgBuffer.width, imgBuffer.height, imgBuffer.stride);
+    ALOGV("processFrame: [%" PRIu64 "]", mFrameNumber);
 
-    // we don't know if there was a stride change until we get
-    // a buffer from the queue. if it changed, we need to resize
+    PerfStats::get().add(PerfStats::FRAMES_PRESENTED);
 
-    rfb::Rect bufRect(0, 0, imgBuffer.width, imgBuffer.height);
+    if (mStartTime > 0) {
+        nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - mStartTime;
+        PerfStats::get().record(PerfStats::FIRST_FRAME, elapsed);
+        ALOGI("First frame after %" PRId64 " ms", ns2ms(elapsed));
+        mStartTime = 0;
+    }
 
-    // performance is extremely bad if the gpu memory is used
-    // directly without copying because it is likely uncached
-    mPixels->imageRect(bufRect, imgBuffer.data, imgBuffer.stride);
+    if (videoRate > 0) {
+        mChurn.update(changed, mPixels->width(), mPixels->height());
+
+        // hold back the busy areas, the rest of the screen stays responsive
+        rfb::Region video = changed.intersect(mChurn.getChurnRegion());
+        if (!video.is_empty()) {
+            changed.assign_subtract(video);
+            mDeferred.assign_union(video);
+            if (!mVideoTimer.isStarted()) {
+                mVideoTimer.start(std::max(1, 1000 / (int)videoRate));
+            }
+        }
+    }
 
-    mVirtualDisplay->getConsumer()->unlockBuffer(imgBuffer);
+    // the copy moves what clients have, so it must not pick up areas
+    // which were held back
+    if (!copied.is_empty()) {
+        if (!mDeferred.is_empty()) {
+            mServer->add_changed(mDeferred);
+            mDeferred.clear();
+        }
+        mServer->add_copied(copied, delta);
+    }
 
     // update clients
-    mServer->add_changed(bufRect);
+    if (!changed.is_empty()) {
+        mServer->add_changed(changed);
+    }
 }
 
 // notifies the server loop that we have changes
@@ -103,6 +249,69 @@ void AndroidDesktop::notify() {
     write(mEventFd, &notify, sizeof(notify));
 }
 
+// capture thread has a frame ready
+void AndroidDesktop::onFrameCaptured() {
+    notify();
+}
+
+// called from a binder thread
+void AndroidDesktop::onParametersChanged() {
+    mParametersChanged = true;
+    notify();
+}
+
+// called from a binder thread
+void AndroidDesktop::setViewport(const Rect& viewport) {
+    {
+        Mutex::Autolock _v(mViewportLock);
+        mPendingViewport = viewport;
+    }
+    onParametersChanged();
+}
+
+void AndroidDesktop::applyParameters() {
+    // only a new value overrides a fallback format or a size the
+    // client asked for
+    android::PixelFormat format = AndroidPixelBuffer::getConfiguredFormat();
+    if (format != mCaptureFormat) {
+        mCaptureFormat = format;
+        mPixels->setBufferFormat(format);
+    }
+
+    int scale = std::max(10, std::min((int)captureScale, 100));
+    if (scale != mCaptureScale) {
+        mCaptureScale = scale;
+        Rect source = mPixels->getSourceRect();
+        mPixels->setWindowSize(source.getWidth() * scale / 100, source.getHeight() * scale / 100);
+    }
+
+    Rect viewport;
+    {
+        Mutex::Autolock _v(mViewportLock);
+        viewport = mPendingViewport;
+    }
+    if (viewport != mViewport) {
+        ALOGI("Viewport changed to [%d,%d %dx%d]", viewport.left, viewport.top,
+              viewport.getWidth(), viewport.getHeight());
+        mViewport = viewport;
+
+        int width = mPixels->width(), height = mPixels->height();
+        updatePixelSource();
+
+        // the projection moves even if the buffer keeps its size
+        if (mPixels->width() == width && mPixels->height() == height) {
+            onBufferDimensionsChanged(width, height);
+        }
+    }
+}
+
+// called from the capture thread
+void AndroidDesktop::onCaptureFormatMismatch(android::PixelFormat format) {
+    ALOGW("Virtual display produced format %x, capture depth is not supported", format);
+    mFormatMismatch = true;
+    notify();
+}
+
 // called when a client resizes the window
 unsigned int AndroidDesktop::setScreenLayout(int reqWidth, int reqHeight,
                                              const rfb::ScreenSet& layout) {
@@ -134,41 +343,161 @@ unsigned int AndroidDesktop::setScreenLayout(int reqWidth, int reqHeight,
 void AndroidDesktop::onFrameAvailable(const BufferItem& item) {
     ALOGV("onFrameAvailable: [%" PRIu64 "] mTimestamp=%" PRId64, item.mFrameNumber, item.mTimestamp);
 
-    notify();
+    sp<FrameCapture> capture = mCapture;
+    if (capture != nullptr) {
+        capture->onFrameAvailable(item);
+    }
 }
 
 void AndroidDesktop::keyEvent(rdr::U32 keysym, __unused_attr rdr::U32 keycode, bool down) {
-    mInputDevice->keyEvent(down, keysym);
+    if (mTrace != nullptr) {
+        mTrace->writeKey(systemTime(SYSTEM_TIME_MONOTONIC), keysym, down);
+    }
+
+    mInputQueue->keyEvent(down, keysym);
 }
 
 void AndroidDesktop::pointerEvent(const rfb::Point& pos, int buttonMask) {
+    if (mTrace != nullptr) {
+        mTrace->writePointer(systemTime(SYSTEM_TIME_MONOTONIC), pos.x, pos.y, buttonMask);
+    }
+
     if (pos.x < mDisplayRect.left || pos.x > mDisplayRect.right || pos.y < mDisplayRect.top ||
         pos.y > mDisplayRect.bottom) {
         // outside viewport
         return;
     }
-    uint32_t x = pos.x * ((float)(mDisplayRect.getWidth()) / (float)mPixels->width());
-    uint32_t y = pos.y * ((float)(mDisplayRect.getHeight()) / (float)mPixels->height());
+
+    // from the framebuffer to the captured area of the display
+    uint32_t x = mSourceRect.left + (pos.x - mDisplayRect.left) *
+                                        ((float)mSourceRect.getWidth() / mDisplayRect.getWidth());
+    uint32_t y = mSourceRect.top + (pos.y - mDisplayRect.top) *
+                                       ((float)mSourceRect.getHeight() / mDisplayRect.getHeight());
 
     ALOGV("pointer xlate x1=%d y1=%d x2=%d y2=%d", pos.x, pos.y, x, y);
 
-    mServer->setCursorPos(rfb::Point(x, y));
-    mInputDevice->pointerEvent(buttonMask, x, y);
+    mServer->setCursorPos(pos);
+    mInputQueue->pointerEvent(buttonMask, x, y);
+}
+
+bool AndroidDesktop::handleTimeout(rfb::Timer* t) {
+    Mutex::Autolock _l(mLock);
+
+    if (t == &mVideoTimer) {
+        // also the final refresh once the area stops changing
+        if (!mDeferred.is_empty()) {
+            mServer->add_changed(mDeferred);
+            mDeferred.clear();
+        }
+        return false;
+    }
+
+    if (t == &mIdleTimer) {
+        ALOGV("No clients for %d ms, releasing the virtual display", (int)idleTimeout);
+        mVirtualDisplay.clear();
+        return false;
+    }
+
+    if (mPixels != nullptr) {
+        updateDisplayInfo();
+        updateScreenState();
+    }
+    return true;
+}
+
+void AndroidDesktop::updateScreenState() {
+    const char* path = screenStatePath;
+    if (path[0] == '\0') {
+        return;
+    }
+
+    char value[16] = "";
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    ssize_t len = read(fd, value, sizeof(value) - 1);
+    close(fd);
+    if (len <= 0) {
+        return;
+    }
+    value[len] = '\0';
+
+    bool off = atoi(value) == 0;
+    if (off == mScreenOff) {
+        return;
+    }
+    mScreenOff = off;
+
+    ALOGI("Display is %s, capture %s", off ? "off" : "on", off ? "paused" : "resumed");
+    if (mVirtualDisplay != nullptr) {
+        mVirtualDisplay->setPaused(off);
+    }
 }
 
 // refresh the display dimensions
 status_t AndroidDesktop::updateDisplayInfo() {
-    status_t err = SurfaceComposerClient::getDisplayInfo(mMainDpy, &mDisplayInfo);
+    DisplayInfo info;
+    status_t err = SurfaceComposerClient::getDisplayInfo(mDpy, &info);
     if (err != NO_ERROR) {
         ALOGE("Failed to get display characteristics\n");
         return err;
     }
 
-    mPixels->setDisplayInfo(&mDisplayInfo);
+    if (mDisplayInfoValid && info.w == mDisplayInfo.w && info.h == mDisplayInfo.h &&
+        info.orientation == mDisplayInfo.orientation) {
+        return NO_ERROR;
+    }
+
+    // a viewport only makes sense in the orientation it was picked in
+    if (mDisplayInfoValid && info.orientation != mDisplayInfo.orientation &&
+        !mViewport.isEmpty()) {
+        ALOGI("Display rotated, capturing all of it again");
+        Mutex::Autolock _v(mViewportLock);
+        mViewport = mPendingViewport = Rect();
+    }
+
+    mDisplayInfo = info;
+    mDisplayInfoValid = true;
+
+    updatePixelSource();
 
     return NO_ERROR;
 }
 
+Rect AndroidDesktop::getCaptureRect() {
+    Rect screen;
+    if (mDisplayInfo.orientation == DISPLAY_ORIENTATION_0 ||
+        mDisplayInfo.orientation == DISPLAY_ORIENTATION_180) {
+        screen = Rect(mDisplayInfo.w, mDisplayInfo.h);
+    } else {
+        screen = Rect(mDisplayInfo.h, mDisplayInfo.w);
+    }
+
+    Rect capture;
+    if (mViewport.isEmpty() || !screen.intersect(mViewport, &capture)) {
+        return screen;
+    }
+    return capture;
+}
+
+void AndroidDesktop::updatePixelSource() {
+    // the pixel buffer sees the captured area as the whole display, so
+    // it is read back at full resolution
+    DisplayInfo source = mDisplayInfo;
+    Rect capture = getCaptureRect();
+    if (mDisplayInfo.orientation == DISPLAY_ORIENTATION_0 ||
+        mDisplayInfo.orientation == DISPLAY_ORIENTATION_180) {
+        source.w = capture.getWidth();
+        source.h = capture.getHeight();
+    } else {
+        source.w = capture.getHeight();
+        source.h = capture.getWidth();
+    }
+
+    mPixels->setDisplayInfo(&source);
+}
+
 rfb::ScreenSet AndroidDesktop::computeScreenLayout() {
     rfb::ScreenSet screens;
     screens.add_screen(rfb::Screen(0, 0, 0, mPixels->width(), mPixels->height(), 0));
@@ -180,12 +509,43 @@ void AndroidDesktop::onBufferDimensionsChanged(uint32_t width, uint32_t height)
     ALOGV("Dimensions changed: old=(%ux%u) new=(%ux%u)", mDisplayRect.getWidth(),
           mDisplayRect.getHeight(), width, height);
 
-    mVirtualDisplay.clear();
-    mVirtualDisplay = new VirtualDisplay(&mDisplayInfo, mPixels->width(), mPixels->height(), this);
+    // the whole framebuffer is sent again anyway
+    mVideoTimer.stop();
+    mDeferred.clear();
+    mChurn.reset();
+
+    // rotations and resizes keep the display and its queue, a new
+    // format needs a new display
+    Rect viewport = getCaptureRect();
+    if (mVirtualDisplay == nullptr ||
+        mVirtualDisplay->reconfigure(&mDisplayInfo, viewport, mPixels->width(),
+                                     mPixels->height(), mPixels->getBufferFormat()) != NO_ERROR) {
+        mCapture->setConsumer(nullptr);
+        mVirtualDisplay.clear();
+        // surfaceflinger numbers the layer stacks of built-in displays
+        // like the displays themselves
+        int stack = layerStack >= 0 ? (int)layerStack : (int)displayNumber;
+        mVirtualDisplay = new VirtualDisplay(&mDisplayInfo, viewport, mPixels->width(),
+                                             mPixels->height(), mPixels->getBufferFormat(),
+                                             stack, this);
+    }
+
+    // a display kept from the last session still holds its last frames,
+    // possibly at the old size, and no capture thread is attached yet
+    if (mVirtualDisplay->isPaused() && !mScreenOff) {
+        mVirtualDisplay->discardQueuedBuffers();
+    }
+    mVirtualDisplay->setPaused(mScreenOff);
 
     mDisplayRect = mVirtualDisplay->getDisplayRect();
+    mSourceRect = mVirtualDisplay->getSourceRect();
+    mScreenRect = mVirtualDisplay->getScreenRect();
+
+    mCapture->setConsumer(mVirtualDisplay->getConsumer(), mVirtualDisplay->getMaxAcquiredBuffers(),
+                          mVirtualDisplay->getFormat());
 
-    mInputDevice->reconfigure(mDisplayRect.getWidth(), mDisplayRect.getHeight());
+    // input covers the whole display, pointers are translated into it
+    mInputDevice->reconfigure(mScreenRect.getWidth(), mScreenRect.getHeight());
 
     mServer->setPixelBuffer(mPixels.get(), computeScreenLayout());
     mServer->setScreenLayout(computeScreenLayout());
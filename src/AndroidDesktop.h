@@ -1,6 +1,7 @@
 #ifndef ANDROID_DESKTOP_H_
 #define ANDROID_DESKTOP_H_
 
+#include <atomic>
 #include <memory>
 
 #include <utils/Condition.h>
@@ -15,9 +16,15 @@
 #include <rfb/PixelBuffer.h>
 #include <rfb/SDesktop.h>
 #include <rfb/ScreenSet.h>
+#include <rfb/Timer.h>
 
 #include "AndroidPixelBuffer.h"
+#include "ChurnTracker.h"
+#include "FrameCapture.h"
+#include "FramePacer.h"
+#include "FrameTrace.h"
 #include "InputDevice.h"
+#include "InputQueue.h"
 #include "VirtualDisplay.h"
 
 using namespace android;
@@ -26,7 +33,9 @@ namespace vncflinger {
 
 class AndroidDesktop : public rfb::SDesktop,
                        public CpuConsumer::FrameAvailableListener,
-                       public AndroidPixelBuffer::BufferDimensionsListener {
+                       public AndroidPixelBuffer::BufferDimensionsListener,
+                       public FrameCapture::FrameCapturedListener,
+                       public rfb::Timer::Callback {
   public:
     AndroidDesktop();
 
@@ -47,25 +56,81 @@ class AndroidDesktop : public rfb::SDesktop,
         return mEventFd;
     }
 
+    FramePacer* getFramePacer() {
+        return &mPacer;
+    }
+
     virtual void onBufferDimensionsChanged(uint32_t width, uint32_t height);
 
     virtual void onFrameAvailable(const BufferItem& item);
 
+    virtual void onFrameCaptured();
+
+    virtual void onCaptureFormatMismatch(android::PixelFormat format);
+
     virtual void queryConnection(network::Socket* sock, const char* userName);
 
+    virtual bool handleTimeout(rfb::Timer* t);
+
+    // a parameter was changed through the binder service, called from a
+    // binder thread. the session picks it up on the server thread.
+    void onParametersChanged();
+
+    // capture only this part of the display, in its current orientation.
+    // an empty rect captures all of it. called from a binder thread.
+    void setViewport(const Rect& viewport);
+
   private:
     virtual void notify();
 
     virtual status_t updateDisplayInfo();
 
+    // pause the virtual display while the physical one is off
+    virtual void updateScreenState();
+
+    // follow capturedepth, capturescale and the viewport, called with
+    // mLock held
+    virtual void applyParameters();
+
+    // the part of the display being captured, in its current orientation
+    virtual Rect getCaptureRect();
+
+    // give the pixel buffer the size of the captured area
+    virtual void updatePixelSource();
+
     virtual rfb::ScreenSet computeScreenLayout();
 
     Rect mDisplayRect;
 
+    // where mDisplayRect comes from on the display, and the whole display
+    Rect mSourceRect;
+    Rect mScreenRect;
+
+    // region of interest in use, and the one last requested
+    Rect mViewport;
+    Rect mPendingViewport;
+    Mutex mViewportLock;
+
     Mutex mLock;
 
     uint64_t mFrameNumber;
 
+    // Decides when the next frame is ingested
+    FramePacer mPacer;
+
+    // Capture thread, owns the consumer side of the virtual display
+    sp<FrameCapture> mCapture;
+
+    // set by the capture thread when the buffer format has to change
+    std::atomic<bool> mFormatMismatch;
+
+    // set by the binder service when parameters changed
+    std::atomic<bool> mParametersChanged;
+
+    // capturedepth and capturescale last applied to the pixel buffer
+    android::PixelFormat mCaptureFormat;
+    int mCaptureScale;
+
     int mEventFd;
 
     // Server instance
@@ -77,12 +142,38 @@ class AndroidDesktop : public rfb::SDesktop,
     // Virtual display controller
     sp<VirtualDisplay> mVirtualDisplay;
 
-    // Primary display
-    sp<IBinder> mMainDpy;
+    // Display being served, the main one unless -display says otherwise
+    sp<IBinder> mDpy;
     DisplayInfo mDisplayInfo;
+    bool mDisplayInfoValid;
+
+    // polls the display for rotation, off the frame path
+    rfb::Timer mDisplayTimer;
+
+    // the virtual display outlives the last client until this fires, so a
+    // reconnect doesn't have to wait for a new one
+    rfb::Timer mIdleTimer;
+
+    // physical display is off, nothing is composited for us
+    bool mScreenOff;
+
+    // when the desktop was started, until the first frame is presented
+    nsecs_t mStartTime;
+
+    // areas which change nearly every frame are sent at a lower rate,
+    // their damage collects here until the timer fires
+    ChurnTracker mChurn;
+    rfb::Region mDeferred;
+    rfb::Timer mVideoTimer;
 
     // Virtual input device
     sp<InputDevice> mInputDevice;
+
+    // Injects input on its own thread
+    sp<InputQueue> mInputQueue;
+
+    // frames and input recorded for vncflinger_bench, if enabled
+    std::unique_ptr<FrameTraceWriter> mTrace;
 };
 };
 
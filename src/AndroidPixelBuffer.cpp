@@ -18,18 +18,40 @@
 #define LOG_TAG "AndroidPixelBuffer"
 #include <utils/Log.h>
 
+#include <algorithm>
+
 #include <ui/DisplayInfo.h>
 
+#include <rfb/Configuration.h>
+
 #include "AndroidPixelBuffer.h"
 
 using namespace vncflinger;
 using namespace android;
 
+static rfb::IntParameter pixelBuffers("pixelbuffers",
+                                      "Number of framebuffers to cycle through (2 or 3)", 2);
+static rfb::IntParameter captureDepth(
+    "capturedepth", "Bits per pixel rendered by the GPU and read back (16 or 32)", 32);
+
 const rfb::PixelFormat AndroidPixelBuffer::sRGBX(32, 24, false, true, 255, 255, 255, 0, 8, 16);
+const rfb::PixelFormat AndroidPixelBuffer::sRGB565(16, 16, false, true, 31, 63, 31, 11, 5, 0);
 
 AndroidPixelBuffer::AndroidPixelBuffer()
-    : ManagedPixelBuffer(), mRotated(false), mScaleX(1.0f), mScaleY(1.0f) {
-    setPF(sRGBX);
+    : FullFramePixelBuffer(),
+      mNumBuffers(2),
+      mFront(0),
+      mReady(-1),
+      mWriting(-1),
+      mReadyFrameNumber(0),
+      mRotated(false),
+      mScaleX(1.0f),
+      mScaleY(1.0f),
+      mListener(nullptr) {
+    mBufferFormat = getConfiguredFormat();
+    format = (mBufferFormat == PIXEL_FORMAT_RGB_565) ? sRGB565 : sRGBX;
+
+    mNumBuffers = std::max(2, std::min(kMaxBuffers, (int)pixelBuffers));
     setSize(0, 0);
 }
 
@@ -37,6 +59,12 @@ AndroidPixelBuffer::~AndroidPixelBuffer() {
     mListener = nullptr;
 }
 
+android::PixelFormat AndroidPixelBuffer::getConfiguredFormat() {
+    // the gpu converts to 16-bit during composition, which halves
+    // the amount of memory read back for low depth clients
+    return captureDepth == 16 ? PIXEL_FORMAT_RGB_565 : PIXEL_FORMAT_RGBX_8888;
+}
+
 bool AndroidPixelBuffer::isDisplayRotated(uint8_t orientation) {
     return orientation != DISPLAY_ORIENTATION_0 && orientation != DISPLAY_ORIENTATION_180;
 }
@@ -47,7 +75,6 @@ void AndroidPixelBuffer::setBufferRotation(bool rotated) {
         mRotated = rotated;
         setSize(height_, width_);
         std::swap(mScaleX, mScaleY);
-        stride = width_;
 
         if (mListener != nullptr) {
             mListener->onBufferDimensionsChanged(width_, height_);
@@ -117,3 +144,189 @@ void AndroidPixelBuffer::setDisplayInfo(DisplayInfo* info) {
 Rect AndroidPixelBuffer::getSourceRect() {
     return Rect(mSourceWidth, mSourceHeight);
 }
+
+void AndroidPixelBuffer::setBufferFormat(android::PixelFormat bufferFormat) {
+    {
+        Mutex::Autolock _l(mLock);
+
+        if (bufferFormat == mBufferFormat) {
+            return;
+        }
+
+        while (mWriting >= 0) {
+            mCondition.wait(mLock);
+        }
+
+        ALOGI("Buffer format changed: old=%d new=%d", mBufferFormat, bufferFormat);
+
+        mBufferFormat = bufferFormat;
+        format = (bufferFormat == PIXEL_FORMAT_RGB_565) ? sRGB565 : sRGBX;
+        resizeLocked(width_, height_);
+    }
+
+    if (mListener != nullptr) {
+        mListener->onBufferDimensionsChanged(width_, height_);
+    }
+}
+
+void AndroidPixelBuffer::setSize(int width, int height) {
+    Mutex::Autolock _l(mLock);
+
+    // the capture thread can't be writing while buffers are replaced
+    while (mWriting >= 0) {
+        mCondition.wait(mLock);
+    }
+
+    resizeLocked(width, height);
+}
+
+void AndroidPixelBuffer::resizeLocked(int width, int height) {
+    size_t needed = (size_t)width * height * (format.bpp / 8);
+
+    // buffers are only reallocated when they grow, so rotating or
+    // shrinking the window reuses the memory we already have
+    for (int i = 0; i < mNumBuffers; i++) {
+        Buffer& buf = mBuffers[i];
+        if (buf.capacity < needed) {
+            ALOGV("Allocating buffer %d: %zu bytes", i, needed);
+            buf.data.reset(new uint8_t[needed]);
+            buf.capacity = needed;
+        }
+        buf.stale.reset(rfb::Rect(0, 0, width, height));
+    }
+
+    width_ = width;
+    height_ = height;
+    stride = width;
+
+    mFront = 0;
+    mReady = -1;
+    mReadyDamage.clear();
+    mReadyCopied.clear();
+    mCarryDamage.clear();
+    data = mBuffers[mFront].data.get();
+}
+
+bool AndroidPixelBuffer::lockBackBuffer(BackBuffer* back) {
+    Mutex::Autolock _l(mLock);
+
+    if (width_ <= 0 || height_ <= 0) {
+        return false;
+    }
+
+    mWriting = -1;
+    for (int i = 0; i < mNumBuffers; i++) {
+        if (i != mFront && i != mReady) {
+            mWriting = i;
+            break;
+        }
+    }
+
+    // all buffers busy, write over the frame which wasn't presented yet
+    if (mWriting < 0) {
+        mWriting = mReady;
+        mReady = -1;
+        mCarryDamage = mReadyDamage.union_(mReadyCopied);
+        mReadyDamage.clear();
+        mReadyCopied.clear();
+    } else {
+        mCarryDamage.clear();
+    }
+
+    back->data = mBuffers[mWriting].data.get();
+    back->bounds = rfb::Rect(0, 0, width_, height_);
+    back->stride = stride;
+    back->format = mBufferFormat;
+    back->stale = mBuffers[mWriting].stale;
+    return true;
+}
+
+bool AndroidPixelBuffer::unlockBackBuffer(const rfb::Region& changed, uint64_t frameNumber,
+                                          const rfb::Region& copied, const rfb::Point& delta) {
+    Mutex::Autolock _l(mLock);
+
+    if (mWriting < 0) {
+        return mReady >= 0;
+    }
+
+    Buffer& buf = mBuffers[mWriting];
+
+    // relative to the front buffer, anything this one was missing
+    // has changed as well
+    rfb::Region damage = changed.union_(buf.stale).union_(mCarryDamage);
+    buf.stale.clear();
+    mCarryDamage.clear();
+
+    // the front buffer only matches the previous frame where it isn't
+    // stale, a frame queued or taken back since then leaves it behind
+    rfb::Region source = copied;
+    source.translate(delta.negate());
+    bool canCopy = !copied.is_empty() && mBuffers[mFront].stale.intersect(source).is_empty();
+
+    if (!damage.is_empty()) {
+        for (int i = 0; i < mNumBuffers; i++) {
+            if (i != mWriting) {
+                mBuffers[i].stale.assign_union(damage);
+            }
+        }
+        mReady = mWriting;
+        mReadyFrameNumber = frameNumber;
+        if (canCopy) {
+            mReadyCopied = copied.intersect(damage);
+            mReadyDelta = delta;
+            mReadyDamage = damage.subtract(mReadyCopied);
+        } else {
+            mReadyCopied.clear();
+            mReadyDamage = damage;
+        }
+    }
+
+    mWriting = -1;
+    mCondition.signal();
+
+    return mReady >= 0;
+}
+
+void AndroidPixelBuffer::cancelBackBuffer() {
+    Mutex::Autolock _l(mLock);
+
+    if (mWriting < 0) {
+        return;
+    }
+
+    // put back a queued frame which was taken over
+    if (!mCarryDamage.is_empty()) {
+        mReady = mWriting;
+        mReadyDamage = mCarryDamage;
+        mCarryDamage.clear();
+    }
+
+    mWriting = -1;
+    mCondition.signal();
+}
+
+bool AndroidPixelBuffer::swapBuffers(rfb::Region* damage, uint64_t* frameNumber,
+                                     rfb::Region* copied, rfb::Point* delta) {
+    Mutex::Autolock _l(mLock);
+
+    if (mReady < 0) {
+        return false;
+    }
+
+    mFront = mReady;
+    mReady = -1;
+    data = mBuffers[mFront].data.get();
+
+    *damage = mReadyDamage;
+    *frameNumber = mReadyFrameNumber;
+    if (copied != nullptr) {
+        *copied = mReadyCopied;
+        *delta = mReadyDelta;
+    } else {
+        damage->assign_union(mReadyCopied);
+    }
+    mReadyDamage.clear();
+    mReadyCopied.clear();
+
+    return !damage->is_empty() || (copied != nullptr && !copied->is_empty());
+}
@@ -18,20 +18,29 @@
 #ifndef ANDROID_PIXEL_BUFFER_H
 #define ANDROID_PIXEL_BUFFER_H
 
+#include <memory>
+
+#include <utils/Condition.h>
 #include <utils/Mutex.h>
 #include <utils/RefBase.h>
 
 #include <ui/DisplayInfo.h>
+#include <ui/PixelFormat.h>
 #include <ui/Rect.h>
 
 #include <rfb/PixelBuffer.h>
 #include <rfb/PixelFormat.h>
+#include <rfb/Rect.h>
+#include <rfb/Region.h>
 
 using namespace android;
 
 namespace vncflinger {
 
-class AndroidPixelBuffer : public RefBase, public rfb::ManagedPixelBuffer {
+// Framebuffer shown to clients. It is backed by a small pool of buffers so
+// the capture thread can fill a back buffer while the encoders read the
+// front one, and the server thread only flips a pointer to present it.
+class AndroidPixelBuffer : public RefBase, public rfb::FullFramePixelBuffer {
   public:
     AndroidPixelBuffer();
 
@@ -58,14 +67,96 @@ class AndroidPixelBuffer : public RefBase, public rfb::ManagedPixelBuffer {
 
     Rect getSourceRect();
 
+    // format the virtual display should render
+    android::PixelFormat getBufferFormat() {
+        return mBufferFormat;
+    }
+
+    // switch formats, e.g. when the gpu can't produce the one we asked for
+    void setBufferFormat(android::PixelFormat bufferFormat);
+
+    // format for the capturedepth parameter
+    static android::PixelFormat getConfiguredFormat();
+
+    struct BackBuffer {
+        uint8_t* data;
+        rfb::Rect bounds;
+        int stride;
+        android::PixelFormat format;
+
+        // area where the contents are older than the newest
+        // frame, this must be refreshed when writing
+        rfb::Region stale;
+    };
+
+    // capture side: get a buffer which isn't being presented. returns
+    // false if there is no framebuffer yet.
+    bool lockBackBuffer(BackBuffer* back);
+
+    // capture side: queue the back buffer for presentation. changed is what
+    // differed from its previous contents. copied is an area of changed
+    // which holds the previous frame moved by delta, it is only passed on
+    // if the front buffer still has that frame. returns true if a frame
+    // is ready.
+    bool unlockBackBuffer(const rfb::Region& changed, uint64_t frameNumber,
+                          const rfb::Region& copied = rfb::Region(),
+                          const rfb::Point& delta = rfb::Point());
+
+    // capture side: give the back buffer up without writing to it
+    void cancelBackBuffer();
+
+    // server side: present the newest frame, returns false if there is none.
+    // without copied the copy is reported as damage instead.
+    bool swapBuffers(rfb::Region* damage, uint64_t* frameNumber,
+                     rfb::Region* copied = nullptr, rfb::Point* delta = nullptr);
+
   private:
+    static const int kMaxBuffers = 3;
+
+    struct Buffer {
+        Buffer() : capacity(0) {
+        }
+
+        std::unique_ptr<uint8_t[]> data;
+        size_t capacity;
+
+        // frames presented since this buffer was last written changed
+        // this area, so its contents may lag behind there
+        rfb::Region stale;
+    };
+
+    void setSize(int width, int height);
+
+    // reallocate for the current size and format, called with mLock held
+    void resizeLocked(int width, int height);
+
+
     static bool isDisplayRotated(uint8_t orientation);
 
     virtual void setBufferRotation(bool rotated);
 
     virtual void updateBufferSize(bool fromDisplay = false);
 
+    // protects the buffer pool
     Mutex mLock;
+    Condition mCondition;
+
+    Buffer mBuffers[kMaxBuffers];
+    int mNumBuffers;
+
+    // presented, queued for presentation and being filled
+    int mFront, mReady, mWriting;
+
+    // damage and frame number of the queued buffer
+    rfb::Region mReadyDamage;
+    uint64_t mReadyFrameNumber;
+
+    // part of the queued frame which is a move of the presented one
+    rfb::Region mReadyCopied;
+    rfb::Point mReadyDelta;
+
+    // damage of a queued buffer which was taken back for writing
+    rfb::Region mCarryDamage;
 
     // width/height is swapped due to display orientation
     bool mRotated;
@@ -82,8 +173,12 @@ class AndroidPixelBuffer : public RefBase, public rfb::ManagedPixelBuffer {
     // callback when buffer size changes
     BufferDimensionsListener* mListener;
 
-    // Android virtual display is always 32-bit
+    // what the virtual display renders into
+    android::PixelFormat mBufferFormat;
+
+    // Android virtual display is 32-bit unless 16-bit capture is enabled
     static const rfb::PixelFormat sRGBX;
+    static const rfb::PixelFormat sRGB565;
 };
 };
 
@@ -0,0 +1,83 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "ChurnTracker"
+#include <utils/Log.h>
+
+#include <algorithm>
+
+#include "ChurnTracker.h"
+
+using namespace vncflinger;
+
+void ChurnTracker::reset() {
+    std::fill(mScores.begin(), mScores.end(), 0);
+    mChurn.clear();
+}
+
+void ChurnTracker::update(const rfb::Region& damage, int width, int height) {
+    int columns = (width + kTileSize - 1) / kTileSize;
+    int rows = (height + kTileSize - 1) / kTileSize;
+
+    if (columns != mColumns || rows != mRows) {
+        mColumns = columns;
+        mRows = rows;
+        mScores.assign((size_t)columns * rows, 0);
+        mChurn.clear();
+    }
+
+    std::vector<uint8_t> hit(mScores.size());
+
+    std::vector<rfb::Rect> rects;
+    damage.get_rects(&rects);
+    for (const rfb::Rect& r : rects) {
+        int x0 = std::max(0, r.tl.x / kTileSize);
+        int y0 = std::max(0, r.tl.y / kTileSize);
+        int x1 = std::min(columns, (r.br.x + kTileSize - 1) / kTileSize);
+        int y1 = std::min(rows, (r.br.y + kTileSize - 1) / kTileSize);
+        for (int y = y0; y < y1; y++) {
+            uint8_t* row = &hit[(size_t)y * columns];
+            std::fill(row + x0, row + x1, 1);
+        }
+    }
+
+    mChurn.clear();
+
+    for (int y = 0; y < rows; y++) {
+        // runs of churning tiles on a row become a single rect
+        int runStart = -1;
+
+        for (int x = 0; x <= columns; x++) {
+            bool churning = false;
+            if (x < columns) {
+                size_t i = (size_t)y * columns + x;
+                uint8_t& score = mScores[i];
+                score = std::min(255, score - score / 4 + (hit[i] ? kHit : 0));
+                churning = score >= kThreshold;
+            }
+
+            if (churning && runStart < 0) {
+                runStart = x;
+            } else if (!churning && runStart >= 0) {
+                mChurn.assign_union(rfb::Region(
+                    rfb::Rect(runStart * kTileSize, y * kTileSize, std::min(width, x * kTileSize),
+                              std::min(height, (y + 1) * kTileSize))));
+                runStart = -1;
+            }
+        }
+    }
+}
@@ -0,0 +1,61 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef CHURN_TRACKER_H
+#define CHURN_TRACKER_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <rfb/Region.h>
+
+namespace vncflinger {
+
+// Tracks how often each tile of the framebuffer changes, so areas
+// showing video or animation can be told apart from static UI.
+class ChurnTracker {
+  public:
+    static const int kTileSize = 64;
+
+    ChurnTracker() : mColumns(0), mRows(0) {
+    }
+
+    // add the damage of a presented frame
+    void update(const rfb::Region& damage, int width, int height);
+
+    // tiles which changed in most of the recent frames
+    const rfb::Region& getChurnRegion() const {
+        return mChurn;
+    }
+
+    void reset();
+
+  private:
+    // every frame a tile's score loses a quarter and gains kHit if it
+    // changed, so a few consecutive changes cross the threshold
+    static const int kHit = 64;
+    static const int kThreshold = 128;
+
+    std::vector<uint8_t> mScores;
+    int mColumns, mRows;
+
+    rfb::Region mChurn;
+};
+};
+
+#endif
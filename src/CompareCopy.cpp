@@ -0,0 +1,191 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "CompareCopy"
+#include <utils/Log.h>
+
+#include <string.h>
+
+#if defined(__aarch64__) || (defined(__arm__) && defined(__ARM_NEON))
+#define HAVE_NEON_KERNEL 1
+#include <arm_neon.h>
+#if defined(__arm__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#elif defined(__i386__) || defined(__x86_64__)
+#define HAVE_SSE41_KERNEL 1
+#include <cpuid.h>
+#include <smmintrin.h>
+#endif
+
+#include "CompareCopy.h"
+
+using namespace vncflinger;
+
+static bool compareCopyScalar(uint8_t* dst, const uint8_t* src, size_t len) {
+    uint64_t diff = 0;
+
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+        uint64_t s, d;
+        memcpy(&s, src, sizeof(s));
+        memcpy(&d, dst, sizeof(d));
+        diff |= s ^ d;
+        memcpy(dst, &s, sizeof(s));
+        src += sizeof(s);
+        dst += sizeof(d);
+    }
+
+    for (; len > 0; len--) {
+        diff |= *dst ^ *src;
+        *dst++ = *src++;
+    }
+
+    return diff != 0;
+}
+
+#ifdef HAVE_NEON_KERNEL
+static bool compareCopyNeon(uint8_t* dst, const uint8_t* src, size_t len) {
+    uint8x16_t acc = vdupq_n_u8(0);
+
+    for (; len >= 64; len -= 64) {
+        uint8x16_t s0, s1, s2, s3;
+
+        __builtin_prefetch(src + 512);
+
+#if defined(__aarch64__)
+        // non-temporal pair loads, the graphics buffer is never read twice
+        asm volatile(
+            "ldnp %q0, %q1, [%4]\n\t"
+            "ldnp %q2, %q3, [%4, #32]"
+            : "=w"(s0), "=w"(s1), "=w"(s2), "=w"(s3)
+            : "r"(src));
+#else
+        s0 = vld1q_u8(src);
+        s1 = vld1q_u8(src + 16);
+        s2 = vld1q_u8(src + 32);
+        s3 = vld1q_u8(src + 48);
+#endif
+
+        acc = vorrq_u8(acc, veorq_u8(s0, vld1q_u8(dst)));
+        acc = vorrq_u8(acc, veorq_u8(s1, vld1q_u8(dst + 16)));
+        acc = vorrq_u8(acc, veorq_u8(s2, vld1q_u8(dst + 32)));
+        acc = vorrq_u8(acc, veorq_u8(s3, vld1q_u8(dst + 48)));
+
+        vst1q_u8(dst, s0);
+        vst1q_u8(dst + 16, s1);
+        vst1q_u8(dst + 32, s2);
+        vst1q_u8(dst + 48, s3);
+
+        src += 64;
+        dst += 64;
+    }
+
+    for (; len >= 16; len -= 16) {
+        uint8x16_t s0 = vld1q_u8(src);
+        acc = vorrq_u8(acc, veorq_u8(s0, vld1q_u8(dst)));
+        vst1q_u8(dst, s0);
+        src += 16;
+        dst += 16;
+    }
+
+    uint64x2_t acc64 = vreinterpretq_u64_u8(acc);
+    bool changed = (vgetq_lane_u64(acc64, 0) | vgetq_lane_u64(acc64, 1)) != 0;
+
+    return compareCopyScalar(dst, src, len) || changed;
+}
+#endif
+
+#ifdef HAVE_SSE41_KERNEL
+__attribute__((target("sse4.1"))) static bool compareCopySse41(uint8_t* dst, const uint8_t* src,
+                                                                size_t len) {
+    // movntdqa needs an aligned source
+    size_t head = (16 - ((uintptr_t)src & 15)) & 15;
+    if (head > len) {
+        head = len;
+    }
+
+    bool changed = compareCopyScalar(dst, src, head);
+    src += head;
+    dst += head;
+    len -= head;
+
+    __m128i acc = _mm_setzero_si128();
+
+    for (; len >= 64; len -= 64) {
+        __m128i s0 = _mm_stream_load_si128((__m128i*)src);
+        __m128i s1 = _mm_stream_load_si128((__m128i*)(src + 16));
+        __m128i s2 = _mm_stream_load_si128((__m128i*)(src + 32));
+        __m128i s3 = _mm_stream_load_si128((__m128i*)(src + 48));
+
+        acc = _mm_or_si128(acc, _mm_xor_si128(s0, _mm_loadu_si128((const __m128i*)dst)));
+        acc = _mm_or_si128(acc, _mm_xor_si128(s1, _mm_loadu_si128((const __m128i*)(dst + 16))));
+        acc = _mm_or_si128(acc, _mm_xor_si128(s2, _mm_loadu_si128((const __m128i*)(dst + 32))));
+        acc = _mm_or_si128(acc, _mm_xor_si128(s3, _mm_loadu_si128((const __m128i*)(dst + 48))));
+
+        _mm_storeu_si128((__m128i*)dst, s0);
+        _mm_storeu_si128((__m128i*)(dst + 16), s1);
+        _mm_storeu_si128((__m128i*)(dst + 32), s2);
+        _mm_storeu_si128((__m128i*)(dst + 48), s3);
+
+        src += 64;
+        dst += 64;
+    }
+
+    for (; len >= 16; len -= 16) {
+        __m128i s0 = _mm_stream_load_si128((__m128i*)src);
+        acc = _mm_or_si128(acc, _mm_xor_si128(s0, _mm_loadu_si128((const __m128i*)dst)));
+        _mm_storeu_si128((__m128i*)dst, s0);
+        src += 16;
+        dst += 16;
+    }
+
+    changed |= !_mm_testz_si128(acc, acc);
+
+    return compareCopyScalar(dst, src, len) || changed;
+}
+#endif
+
+CompareCopy::Kernel CompareCopy::select() {
+#if defined(HAVE_NEON_KERNEL) && defined(__aarch64__)
+    // advanced simd is mandatory on arm64
+    return Kernel{compareCopyNeon, "neon"};
+#elif defined(HAVE_NEON_KERNEL)
+    if (getauxval(AT_HWCAP) & HWCAP_NEON) {
+        return Kernel{compareCopyNeon, "neon"};
+    }
+#elif defined(HAVE_SSE41_KERNEL)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1)) {
+        return Kernel{compareCopySse41, "sse4.1"};
+    }
+#endif
+    return Kernel{compareCopyScalar, "scalar"};
+}
+
+const CompareCopy::Kernel& CompareCopy::kernel() {
+    static const Kernel sKernel = select();
+    return sKernel;
+}
+
+CompareCopyFn CompareCopy::get() {
+    return kernel().fn;
+}
+
+const char* CompareCopy::getName() {
+    return kernel().name;
+}
@@ -0,0 +1,51 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef COMPARE_COPY_H
+#define COMPARE_COPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace vncflinger {
+
+// Copies len bytes from src to dst, returns true if dst was different.
+// src is read exactly once so both happen in a single pass over the
+// (uncached) graphics buffer.
+typedef bool (*CompareCopyFn)(uint8_t* dst, const uint8_t* src, size_t len);
+
+class CompareCopy {
+  public:
+    // kernel for this cpu, chosen on first use so one binary
+    // runs on every device
+    static CompareCopyFn get();
+
+    static const char* getName();
+
+  private:
+    struct Kernel {
+        CompareCopyFn fn;
+        const char* name;
+    };
+
+    static Kernel select();
+
+    static const Kernel& kernel();
+};
+};
+
+#endif
@@ -0,0 +1,328 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "FrameCapture"
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#include <utils/Log.h>
+#include <utils/Trace.h>
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <utils/Timers.h>
+
+#include <ui/PixelFormat.h>
+
+#include <rfb/Configuration.h>
+#include <rfb/Rect.h>
+
+#include "FrameCapture.h"
+#include "PerfStats.h"
+
+using namespace vncflinger;
+using namespace android;
+
+static rfb::IntParameter tileSize("tilesize", "Size of the tiles compared to detect screen changes",
+                                  TileDiff::kDefaultTileSize);
+static rfb::BoolParameter useBufferMetadata(
+    "buffermetadata", "Use buffer damage and timestamps to skip unchanged frames", true);
+static rfb::IntParameter captureThreads("capturethreads",
+                                        "Number of threads used to compare frames", 1);
+static rfb::BoolParameter scrollDetect("scrolldetect",
+                                       "Send vertically scrolled content as copies", true);
+static rfb::BoolParameter tileMatch(
+    "tilematch", "Send tiles moved from elsewhere on the screen as copies", true);
+static rfb::IntParameter captureAffinity(
+    "captureaffinity", "CPU mask for the capture worker threads, 0 for any CPU", 0);
+
+FrameCapture::FrameCapture(const sp<AndroidPixelBuffer>& pixels, FramePacer* pacer,
+                           FrameCapturedListener* listener)
+    : Thread(false),
+      mMaxLockedBuffers(1),
+      mConsumerFormat(PIXEL_FORMAT_RGBX_8888),
+      mDraining(false),
+      mPixels(pixels),
+      mFramesQueued(0),
+      mPacer(pacer),
+      mListener(listener),
+      mTrace(nullptr) {
+    // the pool only lives while clients are connected, so an idle
+    // server has no extra threads
+    updatePoolLocked();
+}
+
+FrameCapture::~FrameCapture() {
+    mListener = nullptr;
+}
+
+void FrameCapture::setConsumer(const sp<CpuConsumer>& consumer, int maxLockedBuffers,
+                               android::PixelFormat format) {
+    Mutex::Autolock _l(mLock);
+
+    mMaxLockedBuffers = maxLockedBuffers;
+    mConsumerFormat = format;
+    mScroll.reset();
+    mTiles.reset();
+
+    // a reconfigured display keeps its queue, and with it the frames
+    // counted and their damage
+    if (consumer == mConsumer) {
+        return;
+    }
+
+    mConsumer = consumer;
+    mMetadata.reset();
+
+    // nothing already in a new queue was counted, so it is drained
+    // and only the newest buffer captured
+    Mutex::Autolock _q(mQueueLock);
+    mDraining = consumer != nullptr;
+    mFramesQueued = mDraining ? 1 : 0;
+    mCondition.signal();
+}
+
+// called from binder thread, must not wait for a capture in progress
+void FrameCapture::onFrameAvailable(const BufferItem& item) {
+    mMetadata.record(item);
+
+    Mutex::Autolock _q(mQueueLock);
+    mFramesQueued++;
+    mCondition.signal();
+}
+
+void FrameCapture::stop() {
+    {
+        Mutex::Autolock _q(mQueueLock);
+        requestExit();
+        mCondition.signal();
+    }
+    join();
+}
+
+bool FrameCapture::threadLoop() {
+    {
+        Mutex::Autolock _q(mQueueLock);
+
+        while (!exitPending() && mFramesQueued == 0) {
+            mCondition.wait(mQueueLock);
+        }
+
+        if (exitPending()) {
+            return false;
+        }
+
+        // hold back until the pacer allows the next frame, anything
+        // queued in the meantime is coalesced into it
+        int wait_ms = mPacer->getTimeUntilNextFrame();
+        if (wait_ms > 0) {
+            mCondition.waitRelative(mQueueLock, ms2ns(wait_ms));
+            return true;
+        }
+    }
+
+    Mutex::Autolock _l(mLock);
+
+    // frames of a detached queue don't matter, the next one is drained
+    if (mConsumer == nullptr) {
+        mFramesQueued = 0;
+        return true;
+    }
+
+    captureLocked();
+    return true;
+}
+
+void FrameCapture::updatePoolLocked() {
+    int threads = std::max(1, (int)captureThreads);
+    if (threads == (mPool != nullptr ? mPool->getThreads() : 1)) {
+        return;
+    }
+
+    ALOGV("Capture threads changed to %d", threads);
+    mPool = threads > 1 ? new WorkerPool(threads, (uint32_t)(int)captureAffinity) : nullptr;
+    mDiff.setWorkerPool(mPool);
+}
+
+void FrameCapture::captureLocked() {
+    ATRACE_CALL();
+
+    // an empty queue ends a drain, it isn't an error
+    bool draining = mDraining;
+    mDraining = false;
+
+    CpuConsumer::LockedBuffer imgBuffer;
+    status_t res;
+    {
+        PerfStats::ScopedTimer timer(PerfStats::LOCK_BUFFER);
+        res = mConsumer->lockNextBuffer(&imgBuffer);
+    }
+    if (res != OK) {
+        if (!draining) {
+            ALOGE("Failed to lock next buffer: %s (%d)", strerror(-res), res);
+        }
+        mFramesQueued = 0;
+        return;
+    }
+    if (--mFramesQueued < 0) {
+        mFramesQueued = 0;
+    }
+
+    // only the newest frame is worth copying, skip anything older. the
+    // consumer has room for one more buffer than we keep, so it can be
+    // locked ahead while draining.
+    while (mFramesQueued > 0 || draining) {
+        if (mMaxLockedBuffers > 1 || draining) {
+            CpuConsumer::LockedBuffer nextBuffer;
+            res = mConsumer->lockNextBuffer(&nextBuffer);
+            if (res != OK) {
+                // keep the frame we already have
+                if (!draining) {
+                    ALOGE("Failed to lock next buffer: %s (%d)", strerror(-res), res);
+                }
+                mFramesQueued = 0;
+                break;
+            }
+            mConsumer->unlockBuffer(imgBuffer);
+            imgBuffer = nextBuffer;
+        } else {
+            mConsumer->unlockBuffer(imgBuffer);
+            res = mConsumer->lockNextBuffer(&imgBuffer);
+            if (res != OK) {
+                ALOGE("Failed to lock next buffer: %s (%d)", strerror(-res), res);
+                mFramesQueued = 0;
+                return;
+            }
+        }
+        if (mFramesQueued > 0) {
+            mFramesQueued--;
+        }
+        PerfStats::get().add(PerfStats::FRAMES_DROPPED);
+        ALOGV("Skipped stale frame, now at [%" PRIu64 "]", imgBuffer.frameNumber);
+    }
+
+    mPacer->frameIngested();
+    PerfStats::get().add(PerfStats::FRAMES_CAPTURED);
+
+    // capturethreads can be changed through the binder service
+    updatePoolLocked();
+
+    ALOGV("captureFrame: [%" PRIu64 "] format: %x (%dx%d, stride=%d)", imgBuffer.frameNumber,
+          imgBuffer.format, imgBuffer.width, imgBuffer.height, imgBuffer.stride);
+
+    AndroidPixelBuffer::BackBuffer back;
+    if (!mPixels->lockBackBuffer(&back)) {
+        mConsumer->unlockBuffer(imgBuffer);
+        return;
+    }
+
+    // a gpu which can't render the requested format falls back to rgbx,
+    // a buffer of the old format was only queued before a change and is
+    // just dropped while the new display is set up
+    int bpp = bytesPerPixel(back.format);
+    if (bytesPerPixel(imgBuffer.format) != bpp) {
+        mConsumer->unlockBuffer(imgBuffer);
+        mPixels->cancelBackBuffer();
+        if (bytesPerPixel(imgBuffer.format) != bytesPerPixel(mConsumerFormat)) {
+            ALOGW("Unexpected buffer format %x (wanted %x)", imgBuffer.format, back.format);
+            if (mListener != nullptr) {
+                mListener->onCaptureFormatMismatch(imgBuffer.format);
+            }
+        } else {
+            ALOGV("Dropped buffer of the previous format %x", imgBuffer.format);
+        }
+        return;
+    }
+
+    if (mTrace != nullptr) {
+        mTrace->writeFrame(imgBuffer.frameNumber, imgBuffer.timestamp, imgBuffer.width,
+                           imgBuffer.height, imgBuffer.stride, imgBuffer.format, imgBuffer.data);
+    }
+
+    // limit the work to what the buffer metadata says can have changed
+    rfb::Rect bufRect = rfb::Rect(0, 0, imgBuffer.width, imgBuffer.height).intersect(back.bounds);
+    rfb::Rect diffRect = bufRect;
+    bool hasContent = mMetadata.filter(imgBuffer, &diffRect);
+
+    // the back buffer also has to catch up on frames it missed
+    rfb::Region diffRegion = back.stale.intersect(rfb::Region(bufRect));
+    if (hasContent || !useBufferMetadata) {
+        mDiff.setTileSize(tileSize);
+        if (useBufferMetadata) {
+            diffRect = mDiff.alignToTiles(diffRect).intersect(bufRect);
+        } else {
+            diffRect = bufRect;
+        }
+        diffRegion.assign_union(rfb::Region(diffRect));
+    }
+
+    // performance is extremely bad if the gpu memory is used
+    // directly without copying because it is likely uncached
+    std::vector<rfb::Rect> rects;
+    diffRegion.get_rects(&rects);
+
+    rfb::Region changed;
+    {
+        PerfStats::ScopedTimer timer(PerfStats::DIFF);
+        for (const rfb::Rect& r : rects) {
+            mDiff.process(r, back.data, back.stride, imgBuffer.data, imgBuffer.stride, bpp,
+                          &changed);
+        }
+    }
+
+    mConsumer->unlockBuffer(imgBuffer);
+
+    // areas which may differ from the previous frame, the back buffer
+    // now holds the new one there. both detectors have to see every frame
+    // to keep their hashes current, a scroll wins over moved tiles.
+    rfb::Region moved = changed.union_(back.stale.intersect(rfb::Region(bufRect)));
+    rfb::Region copied;
+    rfb::Point delta;
+    bool scrolled = false;
+    if (scrollDetect) {
+        rfb::Rect dest;
+        int dy;
+        if (mScroll.update(back.data, back.bounds.width(), back.bounds.height(), back.stride, bpp,
+                           moved, &dest, &dy)) {
+            copied.reset(dest);
+            delta = rfb::Point(0, dy);
+            scrolled = true;
+        }
+    } else {
+        mScroll.reset();
+    }
+    if (tileMatch) {
+        rfb::Region tiles;
+        rfb::Point offset;
+        if (mTiles.update(back.data, back.bounds.width(), back.bounds.height(), back.stride, bpp,
+                          moved, &tiles, &offset) &&
+            !scrolled) {
+            copied = tiles;
+            delta = offset;
+        }
+    } else {
+        mTiles.reset();
+    }
+
+    bool ready = mPixels->unlockBackBuffer(changed, imgBuffer.frameNumber, copied, delta);
+
+    if (ready && mListener != nullptr) {
+        mListener->onFrameCaptured();
+    }
+}
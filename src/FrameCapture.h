@@ -0,0 +1,135 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include <atomic>
+
+#include <utils/Condition.h>
+#include <utils/Mutex.h>
+#include <utils/Thread.h>
+
+#include <gui/BufferItem.h>
+#include <gui/CpuConsumer.h>
+
+#include <rfb/Region.h>
+
+#include "AndroidPixelBuffer.h"
+#include "FrameMetadata.h"
+#include "FramePacer.h"
+#include "FrameTrace.h"
+#include "ScrollDetector.h"
+#include "TileDiff.h"
+#include "TileMatcher.h"
+#include "WorkerPool.h"
+
+using namespace android;
+
+namespace vncflinger {
+
+// Owns the lock/copy/unlock of buffers from the virtual display so the
+// network thread never touches graphics memory. Frames are written into
+// a back buffer of the pixel buffer, which the server thread presents.
+class FrameCapture : public Thread {
+  public:
+    class FrameCapturedListener {
+      public:
+        virtual void onFrameCaptured() = 0;
+
+        // buffers arrive in a different format than the one requested
+        virtual void onCaptureFormatMismatch(android::PixelFormat format) = 0;
+        virtual ~FrameCapturedListener() {
+        }
+    };
+
+    FrameCapture(const sp<AndroidPixelBuffer>& pixels, FramePacer* pacer,
+                 FrameCapturedListener* listener);
+
+    virtual ~FrameCapture();
+
+    // switch to a new buffer queue, or stop capturing if consumer is null.
+    // with more than one locked buffer the next frame is locked before
+    // the current one is released. format is the one the queue was
+    // created for.
+    void setConsumer(const sp<CpuConsumer>& consumer, int maxLockedBuffers = 1,
+                     android::PixelFormat format = PIXEL_FORMAT_RGBX_8888);
+
+    // also write every captured buffer to a trace, set before running
+    void setTraceWriter(FrameTraceWriter* trace) {
+        mTrace = trace;
+    }
+
+    // called from the binder thread when a buffer is queued
+    void onFrameAvailable(const BufferItem& item);
+
+    void stop();
+
+  private:
+    virtual bool threadLoop();
+
+    // lock the newest buffer and write its changes, called with mLock held
+    void captureLocked();
+
+    // resize the worker pool to the capturethreads parameter
+    void updatePoolLocked();
+
+    // protects the consumer, held while a buffer is locked
+    Mutex mLock;
+
+    sp<CpuConsumer> mConsumer;
+    int mMaxLockedBuffers;
+    android::PixelFormat mConsumerFormat;
+
+    // the consumer was replaced, its queue has to be emptied
+    bool mDraining;
+
+    sp<AndroidPixelBuffer> mPixels;
+
+    // wakes the capture thread, never held for long since
+    // onFrameAvailable blocks the producer
+    Mutex mQueueLock;
+    Condition mCondition;
+
+    // frames queued by the virtual display but not yet locked
+    std::atomic<int> mFramesQueued;
+
+    // Decides when the next frame is ingested
+    FramePacer* mPacer;
+
+    FrameCapturedListener* mListener;
+
+    // Damage and timestamps reported with each buffer
+    FrameMetadata mMetadata;
+
+    // Damage detection against the previous frame
+    TileDiff mDiff;
+
+    // finds scrolled content in the changed rows
+    ScrollDetector mScroll;
+
+    // finds tiles which moved by the same offset
+    TileMatcher mTiles;
+
+    // extra threads for the diff, if enabled
+    sp<WorkerPool> mPool;
+
+    FrameTraceWriter* mTrace;
+};
+};
+
+#endif
@@ -0,0 +1,100 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "FrameMetadata"
+#include <utils/Log.h>
+
+#include <inttypes.h>
+
+#include "FrameMetadata.h"
+
+using namespace vncflinger;
+
+void FrameMetadata::record(const BufferItem& item) {
+    Mutex::Autolock _l(mLock);
+
+    Entry& entry = mEntries[item.mFrameNumber];
+    entry.damage = item.mSurfaceDamage;
+    entry.timestamp = item.mTimestamp;
+    entry.autoTimestamp = item.mIsAutoTimestamp;
+
+    while (mEntries.size() > kMaxEntries) {
+        mEntries.erase(mEntries.begin());
+    }
+}
+
+bool FrameMetadata::filter(const CpuConsumer::LockedBuffer& buffer, rfb::Rect* bounds) {
+    Entry entry;
+    bool valid;
+
+    {
+        Mutex::Autolock _l(mLock);
+
+        auto it = mEntries.find(buffer.frameNumber);
+        if (it == mEntries.end()) {
+            // no metadata, the whole buffer has to be compared
+            mEntries.erase(mEntries.begin(), mEntries.lower_bound(buffer.frameNumber));
+            return true;
+        }
+
+        entry = it->second;
+        valid = isValid(entry.damage);
+
+        // frames which were skipped still contribute their damage
+        for (auto prev = mEntries.begin(); valid && prev != it; prev++) {
+            if (!isValid(prev->second.damage)) {
+                valid = false;
+            } else {
+                entry.damage.orSelf(prev->second.damage);
+            }
+        }
+        mEntries.erase(mEntries.begin(), ++it);
+    }
+
+    // the same presentation time means the same content was queued again
+    if (!entry.autoTimestamp && entry.timestamp == mLastTimestamp) {
+        ALOGV("Dropping frame %" PRIu64 ": duplicate timestamp", buffer.frameNumber);
+        return false;
+    }
+    mLastTimestamp = entry.timestamp;
+
+    if (!buffer.crop.isEmpty()) {
+        *bounds = bounds->intersect(
+            rfb::Rect(buffer.crop.left, buffer.crop.top, buffer.crop.right, buffer.crop.bottom));
+    }
+
+    if (!valid) {
+        return !bounds->is_empty();
+    }
+
+    if (entry.damage.isEmpty()) {
+        ALOGV("Dropping frame %" PRIu64 ": no damage", buffer.frameNumber);
+        return false;
+    }
+
+    Rect damage = entry.damage.getBounds();
+    *bounds = bounds->intersect(rfb::Rect(damage.left, damage.top, damage.right, damage.bottom));
+
+    return !bounds->is_empty();
+}
+
+void FrameMetadata::reset() {
+    Mutex::Autolock _l(mLock);
+
+    mEntries.clear();
+    mLastTimestamp = -1;
+}
@@ -0,0 +1,78 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef FRAME_METADATA_H
+#define FRAME_METADATA_H
+
+#include <map>
+
+#include <utils/Mutex.h>
+
+#include <gui/BufferItem.h>
+#include <gui/CpuConsumer.h>
+
+#include <ui/Region.h>
+
+#include <rfb/Rect.h>
+
+using namespace android;
+
+namespace vncflinger {
+
+// Keeps the damage and timestamp of queued buffers so frames without
+// new content can be dropped before their pixels are read. Frames
+// without usable metadata always pass through to the tile diff.
+class FrameMetadata {
+  public:
+    FrameMetadata() : mLastTimestamp(-1) {
+    }
+
+    // called from the binder thread when a buffer is queued
+    void record(const BufferItem& item);
+
+    // narrows bounds to the area which can have changed, returns false
+    // if the frame has no new content at all
+    bool filter(const CpuConsumer::LockedBuffer& buffer, rfb::Rect* bounds);
+
+    // forget everything, used when the buffer queue is recreated
+    void reset();
+
+  private:
+    struct Entry {
+        Region damage;
+        int64_t timestamp;
+        bool autoTimestamp;
+    };
+
+    static bool isValid(const Region& damage) {
+        return damage.getBounds() != Rect::INVALID_RECT;
+    }
+
+    Mutex mLock;
+
+    // frames which were queued but not yet processed
+    std::map<uint64_t, Entry> mEntries;
+
+    // timestamp of the last frame which was let through
+    int64_t mLastTimestamp;
+
+    // bound the map if frames are never acquired
+    static const size_t kMaxEntries = 16;
+};
+};
+
+#endif
@@ -0,0 +1,162 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "FramePacer"
+#include <utils/Log.h>
+
+#include <inttypes.h>
+
+#include <algorithm>
+
+#include <rfb/Configuration.h>
+
+#include "FramePacer.h"
+
+using namespace vncflinger;
+
+static rfb::IntParameter captureRate("capturerate", "Maximum number of frames captured per second",
+                                     60);
+static rfb::IntParameter clientFrameRate("clientframerate",
+                                         "Maximum number of frames per second for each client", 60);
+static rfb::IntParameter congestionBytes(
+    "congestionbytes", "Client output backlog in bytes at which its frame rate is reduced", 65536);
+static rfb::IntParameter latencyTarget(
+    "latencytarget",
+    "Time in ms a client's queued output may take to send before its frame rate is reduced, "
+    "0 to only use congestionbytes",
+    0);
+
+void FramePacer::setClientBacklog(network::Socket* sock, size_t bytes, uint64_t sent) {
+    android::Mutex::Autolock _l(mLock);
+
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    Client& client = mClients[sock];
+
+    if (client.sampleStart == 0 || client.backlog == 0) {
+        // an idle link says nothing about its capacity
+        client.sampleStart = now;
+        client.sampleSent = sent;
+    } else if (now - client.sampleStart >= kSampleInterval) {
+        double bps = (double)(sent - client.sampleSent) * s2ns(1) / (now - client.sampleStart);
+        client.throughput =
+            client.throughput == 0 ? bps : client.throughput * 0.75 + bps * 0.25;
+        client.sampleStart = now;
+        client.sampleSent = sent;
+    }
+
+    client.backlog = bytes;
+    client.sent = sent;
+}
+
+void FramePacer::removeClient(network::Socket* sock) {
+    android::Mutex::Autolock _l(mLock);
+
+    mClients.erase(sock);
+}
+
+nsecs_t FramePacer::getFrameInterval() {
+    if (mClients.empty()) {
+        return s2ns(1) / std::max(1, (int)captureRate);
+    }
+
+    int rate = std::max(1, std::min((int)captureRate, (int)clientFrameRate));
+    nsecs_t base = s2ns(1) / rate;
+
+    if (latencyTarget > 0) {
+        nsecs_t interval = s2ns(1);
+        for (const auto& it : mClients) {
+            double clientRate = it.second.rate > 0 ? it.second.rate : rate;
+            interval = std::min(interval, (nsecs_t)(s2ns(1) / clientRate));
+        }
+        return std::max(base, interval);
+    }
+
+    nsecs_t interval = base << kMaxBackoff;
+    for (const auto& it : mClients) {
+        interval = std::min(interval, base << it.second.backoff);
+    }
+    return interval;
+}
+
+void FramePacer::adjustRateLocked(network::Socket* sock, Client* client, nsecs_t now) {
+    double maxRate = std::max(1, std::min((int)captureRate, (int)clientFrameRate));
+    nsecs_t target = ms2ns((int)latencyTarget);
+
+    if (client->rate <= 0) {
+        client->rate = maxRate;
+    }
+
+    // time the queued output needs to reach the client
+    nsecs_t delay;
+    if (client->backlog == 0) {
+        delay = 0;
+    } else if (client->throughput > 0) {
+        delay = (nsecs_t)(client->backlog * s2ns(1) / client->throughput);
+    } else {
+        delay = client->backlog > (size_t)(int)congestionBytes ? target + 1 : 0;
+    }
+
+    if (delay > target) {
+        // back off at most once per target period, so the previous
+        // decrease has time to show up in the backlog
+        if (now - client->lastDecrease >= target) {
+            client->rate = std::max(1.0, client->rate * 0.75);
+            client->lastDecrease = now;
+            ALOGV("Client %p over latency target (%" PRId64 "ms), rate=%.1f", sock, ns2ms(delay),
+                  client->rate);
+        }
+    } else if (delay < target / 2 && client->rate < maxRate) {
+        client->rate = std::min(maxRate, client->rate + 1);
+    }
+}
+
+int FramePacer::getTimeUntilNextFrame() {
+    android::Mutex::Autolock _l(mLock);
+
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t due = mLastFrame + getFrameInterval();
+
+    if (now >= due) {
+        return 0;
+    }
+
+    // round up so the caller doesn't wake early and spin
+    return (int)((due - now + ms2ns(1) - 1) / ms2ns(1));
+}
+
+void FramePacer::frameIngested() {
+    android::Mutex::Autolock _l(mLock);
+
+    mLastFrame = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    for (auto& it : mClients) {
+        Client& client = it.second;
+        if (latencyTarget > 0) {
+            adjustRateLocked(it.first, &client, mLastFrame);
+            continue;
+        }
+        if (client.backlog > (size_t)(int)congestionBytes) {
+            if (client.backoff < kMaxBackoff) {
+                client.backoff++;
+                ALOGV("Client %p congested (%zu bytes), backoff=%d", it.first, client.backlog,
+                      client.backoff);
+            }
+        } else if (client.backlog == 0 && client.backoff > 0) {
+            client.backoff--;
+        }
+    }
+}
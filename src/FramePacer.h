@@ -0,0 +1,101 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+#include <map>
+
+#include <utils/Mutex.h>
+#include <utils/Timers.h>
+
+#include <network/Socket.h>
+
+namespace vncflinger {
+
+// Decides when the next frame should be ingested. The rate is capped
+// by the server and per client, and a client whose output buffer stays
+// backed up gets its rate halved until it drains again. With a latency
+// target, each client instead gets a rate from its measured throughput
+// so its queued output drains within the target. Since frames are
+// shared, the fastest client sets the pace. Clients are reported by the
+// server thread while the capture thread asks for the schedule.
+class FramePacer {
+  public:
+    FramePacer() : mLastFrame(0) {
+    }
+
+    // report how many bytes are waiting in a client's output buffer, and
+    // how many were written to its socket in total
+    void setClientBacklog(network::Socket* sock, size_t bytes, uint64_t sent);
+
+    void removeClient(network::Socket* sock);
+
+    // ms until the next frame is due, 0 if it can be ingested now
+    int getTimeUntilNextFrame();
+
+    // call after a frame was ingested
+    void frameIngested();
+
+  private:
+    static const int kMaxBackoff = 4;
+
+    // throughput is sampled at most this often
+    static const nsecs_t kSampleInterval = 100000000;
+
+    struct Client {
+        Client()
+            : backlog(0),
+              backoff(0),
+              sent(0),
+              sampleStart(0),
+              sampleSent(0),
+              throughput(0),
+              rate(0),
+              lastDecrease(0) {
+        }
+
+        size_t backlog;
+        int backoff;
+
+        // bytes written so far, and where the current sample started
+        uint64_t sent;
+        nsecs_t sampleStart;
+        uint64_t sampleSent;
+
+        // bytes per second while the link was busy, 0 until measured
+        double throughput;
+
+        // frames per second allowed by the latency target
+        double rate;
+        nsecs_t lastDecrease;
+    };
+
+    nsecs_t getFrameInterval();
+
+    // fit a client's rate to the latency target, called with mLock held
+    void adjustRateLocked(network::Socket* sock, Client* client, nsecs_t now);
+
+    android::Mutex mLock;
+
+    std::map<network::Socket*, Client> mClients;
+
+    nsecs_t mLastFrame;
+};
+};
+
+#endif
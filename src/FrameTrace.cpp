@@ -0,0 +1,204 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "FrameTrace"
+#include <utils/Log.h>
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "FrameTrace.h"
+
+using namespace vncflinger;
+using namespace android;
+
+static const char kMagic[4] = {'V', 'N', 'C', 'T'};
+static const uint32_t kVersion = 1;
+
+template <typename T>
+static void put(FILE* file, const T& value) {
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+template <typename T>
+static bool get(FILE* file, T* value) {
+    return fread(value, sizeof(*value), 1, file) == 1;
+}
+
+FrameTraceWriter::~FrameTraceWriter() {
+    if (mFile != nullptr) {
+        fclose(mFile);
+    }
+}
+
+status_t FrameTraceWriter::open(const char* path) {
+    Mutex::Autolock _l(mLock);
+
+    mFile = fopen(path, "we");
+    if (mFile == nullptr) {
+        ALOGE("Failed to open trace %s: %s", path, strerror(errno));
+        return NAME_NOT_FOUND;
+    }
+
+    fwrite(kMagic, sizeof(kMagic), 1, mFile);
+    put(mFile, kVersion);
+
+    ALOGI("Recording trace to %s", path);
+    return NO_ERROR;
+}
+
+void FrameTraceWriter::writeHeaderLocked(FrameTraceRecord::Type type, nsecs_t timestamp) {
+    put(mFile, (uint8_t)type);
+    put(mFile, (int64_t)timestamp);
+}
+
+void FrameTraceWriter::writeFrame(uint64_t frameNumber, nsecs_t timestamp, uint32_t width,
+                                  uint32_t height, uint32_t stride, PixelFormat format,
+                                  const uint8_t* data) {
+    Mutex::Autolock _l(mLock);
+    if (mFile == nullptr) {
+        return;
+    }
+
+    size_t bpp = bytesPerPixel(format);
+    size_t rowLen = width * bpp;
+
+    mPacked.resize(rowLen * height);
+    for (uint32_t y = 0; y < height; y++) {
+        memcpy(&mPacked[y * rowLen], data + y * stride * bpp, rowLen);
+    }
+
+    uLongf compressedLen = compressBound(mPacked.size());
+    mCompressed.resize(compressedLen);
+    if (compress2(mCompressed.data(), &compressedLen, mPacked.data(), mPacked.size(),
+                  Z_BEST_SPEED) != Z_OK) {
+        ALOGE("Failed to compress frame %" PRIu64, frameNumber);
+        return;
+    }
+
+    writeHeaderLocked(FrameTraceRecord::FRAME, timestamp);
+    put(mFile, frameNumber);
+    put(mFile, width);
+    put(mFile, height);
+    put(mFile, (int32_t)format);
+    put(mFile, (uint32_t)mPacked.size());
+    put(mFile, (uint32_t)compressedLen);
+    fwrite(mCompressed.data(), compressedLen, 1, mFile);
+}
+
+void FrameTraceWriter::writeKey(nsecs_t timestamp, uint32_t keysym, bool down) {
+    Mutex::Autolock _l(mLock);
+    if (mFile == nullptr) {
+        return;
+    }
+
+    writeHeaderLocked(FrameTraceRecord::KEY, timestamp);
+    put(mFile, keysym);
+    put(mFile, (uint8_t)down);
+}
+
+void FrameTraceWriter::writePointer(nsecs_t timestamp, int32_t x, int32_t y, int32_t buttonMask) {
+    Mutex::Autolock _l(mLock);
+    if (mFile == nullptr) {
+        return;
+    }
+
+    writeHeaderLocked(FrameTraceRecord::POINTER, timestamp);
+    put(mFile, x);
+    put(mFile, y);
+    put(mFile, buttonMask);
+}
+
+FrameTraceReader::~FrameTraceReader() {
+    if (mFile != nullptr) {
+        fclose(mFile);
+    }
+}
+
+status_t FrameTraceReader::open(const char* path) {
+    mFile = fopen(path, "re");
+    if (mFile == nullptr) {
+        ALOGE("Failed to open trace %s: %s", path, strerror(errno));
+        return NAME_NOT_FOUND;
+    }
+
+    char magic[sizeof(kMagic)];
+    uint32_t version;
+    if (fread(magic, sizeof(magic), 1, mFile) != 1 || memcmp(magic, kMagic, sizeof(magic)) ||
+        !get(mFile, &version) || version != kVersion) {
+        ALOGE("%s is not a trace this version can read", path);
+        return BAD_VALUE;
+    }
+    return NO_ERROR;
+}
+
+bool FrameTraceReader::next(FrameTraceRecord* record) {
+    uint8_t type;
+    int64_t timestamp;
+    if (mFile == nullptr || !get(mFile, &type) || !get(mFile, &timestamp)) {
+        return false;
+    }
+
+    record->type = (FrameTraceRecord::Type)type;
+    record->timestamp = timestamp;
+
+    switch (record->type) {
+        case FrameTraceRecord::FRAME: {
+            int32_t format;
+            uint32_t rawLen, compressedLen;
+            if (!get(mFile, &record->frameNumber) || !get(mFile, &record->width) ||
+                !get(mFile, &record->height) || !get(mFile, &format) || !get(mFile, &rawLen) ||
+                !get(mFile, &compressedLen)) {
+                return false;
+            }
+            record->format = format;
+
+            mCompressed.resize(compressedLen);
+            record->pixels.resize(rawLen);
+            if (fread(mCompressed.data(), compressedLen, 1, mFile) != 1) {
+                return false;
+            }
+
+            uLongf len = rawLen;
+            if (uncompress(record->pixels.data(), &len, mCompressed.data(), compressedLen) !=
+                    Z_OK ||
+                len != rawLen) {
+                ALOGE("Corrupt frame %" PRIu64 " in trace", record->frameNumber);
+                return false;
+            }
+            return true;
+        }
+
+        case FrameTraceRecord::KEY: {
+            uint8_t down;
+            if (!get(mFile, &record->keysym) || !get(mFile, &down)) {
+                return false;
+            }
+            record->down = down;
+            return true;
+        }
+
+        case FrameTraceRecord::POINTER:
+            return get(mFile, &record->x) && get(mFile, &record->y) &&
+                   get(mFile, &record->buttonMask);
+    }
+
+    ALOGE("Unknown record type %d in trace", type);
+    return false;
+}
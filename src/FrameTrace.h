@@ -0,0 +1,108 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef FRAME_TRACE_H
+#define FRAME_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include <utils/Errors.h>
+#include <utils/Mutex.h>
+#include <utils/Timers.h>
+
+#include <ui/PixelFormat.h>
+
+namespace vncflinger {
+
+// Captured frames and client input in the order they happened, so the
+// pipeline can be replayed off the device by vncflinger_bench. Frames
+// are stored without stride padding and compressed with zlib.
+struct FrameTraceRecord {
+    enum Type : uint8_t { FRAME = 1, KEY = 2, POINTER = 3 };
+
+    Type type;
+    nsecs_t timestamp;
+
+    // FRAME
+    uint64_t frameNumber;
+    uint32_t width;
+    uint32_t height;
+    android::PixelFormat format;
+    std::vector<uint8_t> pixels;
+
+    // KEY
+    uint32_t keysym;
+    bool down;
+
+    // POINTER
+    int32_t x;
+    int32_t y;
+    int32_t buttonMask;
+};
+
+class FrameTraceWriter {
+  public:
+    FrameTraceWriter() : mFile(nullptr) {
+    }
+
+    ~FrameTraceWriter();
+
+    android::status_t open(const char* path);
+
+    // stride is in pixels
+    void writeFrame(uint64_t frameNumber, nsecs_t timestamp, uint32_t width, uint32_t height,
+                    uint32_t stride, android::PixelFormat format, const uint8_t* data);
+
+    void writeKey(nsecs_t timestamp, uint32_t keysym, bool down);
+
+    void writePointer(nsecs_t timestamp, int32_t x, int32_t y, int32_t buttonMask);
+
+  private:
+    void writeHeaderLocked(FrameTraceRecord::Type type, nsecs_t timestamp);
+
+    // frames come from the capture thread, input from the server thread
+    android::Mutex mLock;
+
+    FILE* mFile;
+
+    std::vector<uint8_t> mPacked;
+    std::vector<uint8_t> mCompressed;
+};
+
+class FrameTraceReader {
+  public:
+    FrameTraceReader() : mFile(nullptr) {
+    }
+
+    ~FrameTraceReader();
+
+    android::status_t open(const char* path);
+
+    // false at the end of the trace or if it is corrupt
+    bool next(FrameTraceRecord* record);
+
+  private:
+    FILE* mFile;
+
+    std::vector<uint8_t> mCompressed;
+};
+};
+
+#endif
@@ -16,22 +16,31 @@
 //
 
 #define LOG_TAG "VNC-InputDevice"
+#define ATRACE_TAG ATRACE_TAG_INPUT
 #include <utils/Log.h>
+#include <utils/Trace.h>
 
+#include <algorithm>
 #include <future>
 
 #include "InputDevice.h"
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <sys/time.h>
 
 #include <sys/ioctl.h>
 
 #include <linux/input.h>
 #include <linux/uinput.h>
 
+#include <rfb/Configuration.h>
+
 using namespace android;
 
+static rfb::BoolParameter multiTouch("multitouch",
+                                     "Create a multi-touch (protocol B) input device", false);
+
 
 static const struct UInputOptions {
     int cmd;
@@ -50,9 +59,35 @@ static const struct UInputOptions {
     {UI_SET_PROPBIT, INPUT_PROP_DIRECT},
 };
 
+static const struct UInputOptions kMultiTouchOptions[] = {
+    {UI_SET_ABSBIT, ABS_MT_SLOT},
+    {UI_SET_ABSBIT, ABS_MT_TRACKING_ID},
+    {UI_SET_ABSBIT, ABS_MT_POSITION_X},
+    {UI_SET_ABSBIT, ABS_MT_POSITION_Y},
+};
+
 status_t InputDevice::start_async(uint32_t width, uint32_t height) {
+    Mutex::Autolock _l(mLock);
+
+    mWidth = width;
+    mHeight = height;
+
+    if (mFD >= 0 || mStarting) {
+        // an open device picks up the new size on the next event
+        return NO_ERROR;
+    }
+
     // don't block the caller since this can take a few seconds
-    std::async(&InputDevice::start, this, width, height);
+    mStarting = true;
+    mStartResult = std::async(std::launch::async, [this]() -> status_t {
+        Mutex::Autolock _l(mLock);
+        if (!mStarting) {
+            // stopped before we got here
+            return NO_INIT;
+        }
+        mStarting = false;
+        return startLocked();
+    });
 
     return NO_ERROR;
 }
@@ -60,8 +95,22 @@ status_t InputDevice::start_async(uint32_t width, uint32_t height) {
 status_t InputDevice::start(uint32_t width, uint32_t height) {
     Mutex::Autolock _l(mLock);
 
+    mWidth = width;
+    mHeight = height;
+
+    return startLocked();
+}
+
+status_t InputDevice::startLocked() {
     mLeftClicked = mMiddleClicked = mRightClicked = false;
 
+    mMultiTouch = multiTouch;
+    mTouching = false;
+    mNextTrackingId = 0;
+    for (int i = 0; i < kMaxContacts; i++) {
+        mSlots[i] = -1;
+    }
+
     struct input_id id = {
         BUS_VIRTUAL, /* Bus type */
         1,           /* Vendor */
@@ -88,6 +137,15 @@ status_t InputDevice::start(uint32_t width, uint32_t height) {
         }
     }
 
+    for (idx = 0; mMultiTouch && idx < sizeof(kMultiTouchOptions) / sizeof(kMultiTouchOptions[0]);
+         idx++) {
+        if (ioctl(mFD, kMultiTouchOptions[idx].cmd, kMultiTouchOptions[idx].bit) < 0) {
+            ALOGE("uinput ioctl failed: %d %d", kMultiTouchOptions[idx].cmd,
+                  kMultiTouchOptions[idx].bit);
+            goto err_ioctl;
+        }
+    }
+
     for (idx = 0; idx < KEY_MAX; idx++) {
         if (ioctl(mFD, UI_SET_KEYBIT, idx) < 0) {
             ALOGE("UI_SET_KEYBIT failed");
@@ -96,14 +154,23 @@ status_t InputDevice::start(uint32_t width, uint32_t height) {
     }
 
     memset(&mUserDev, 0, sizeof(mUserDev));
-    strncpy(mUserDev.name, "VNC-RemoteInput", UINPUT_MAX_NAME_SIZE);
+    strncpy(mUserDev.name, mName.c_str(), UINPUT_MAX_NAME_SIZE - 1);
 
     mUserDev.id = id;
 
+    // fixed range, events are scaled to the current display size so the
+    // device never has to be recreated when it changes
     mUserDev.absmin[ABS_X] = 0;
-    mUserDev.absmax[ABS_X] = width;
+    mUserDev.absmax[ABS_X] = kAbsMax;
     mUserDev.absmin[ABS_Y] = 0;
-    mUserDev.absmax[ABS_Y] = height;
+    mUserDev.absmax[ABS_Y] = kAbsMax;
+
+    if (mMultiTouch) {
+        mUserDev.absmax[ABS_MT_SLOT] = kMaxContacts - 1;
+        mUserDev.absmax[ABS_MT_TRACKING_ID] = 0xffff;
+        mUserDev.absmax[ABS_MT_POSITION_X] = kAbsMax;
+        mUserDev.absmax[ABS_MT_POSITION_Y] = kAbsMax;
+    }
 
     if (write(mFD, &mUserDev, sizeof(mUserDev)) != sizeof(mUserDev)) {
         ALOGE("Failed to configure uinput device");
@@ -117,7 +184,7 @@ status_t InputDevice::start(uint32_t width, uint32_t height) {
 
     mOpened = true;
 
-    ALOGD("Virtual input device created successfully (%dx%d)", width, height);
+    ALOGD("Virtual input device created successfully (%dx%d)", mWidth, mHeight);
     return NO_ERROR;
 
 err_ioctl:
@@ -129,7 +196,6 @@ err_ioctl:
 }
 
 status_t InputDevice::reconfigure(uint32_t width, uint32_t height) {
-    stop();
     return start_async(width, height);
 }
 
@@ -137,6 +203,7 @@ status_t InputDevice::stop() {
     Mutex::Autolock _l(mLock);
 
     mOpened = false;
+    mStarting = false;
 
     if (mFD < 0) {
         return OK;
@@ -149,51 +216,76 @@ status_t InputDevice::stop() {
     return OK;
 }
 
-status_t InputDevice::inject(uint16_t type, uint16_t code, int32_t value) {
-    struct input_event event;
-    memset(&event, 0, sizeof(event));
-    gettimeofday(&event.time, 0); /* This should not be able to fail ever.. */
-    event.type = type;
-    event.code = code;
-    event.value = value;
-    if (write(mFD, &event, sizeof(event)) != sizeof(event)) return BAD_VALUE;
-    return OK;
+void InputDevice::inject(uint16_t type, uint16_t code, int32_t value) {
+    if (mBatchCount == kMaxBatch) {
+        flush();
+    }
+
+    struct input_event* event = &mBatch[mBatchCount++];
+    memset(event, 0, sizeof(*event));
+    event->type = type;
+    event->code = code;
+    event->value = value;
 }
 
-status_t InputDevice::injectSyn(uint16_t type, uint16_t code, int32_t value) {
-    if (inject(type, code, value) != OK) {
-        return BAD_VALUE;
-    }
-    return inject(EV_SYN, SYN_REPORT, 0);
+void InputDevice::injectSyn(uint16_t type, uint16_t code, int32_t value) {
+    inject(type, code, value);
+    inject(EV_SYN, SYN_REPORT, 0);
 }
 
-status_t InputDevice::movePointer(int32_t x, int32_t y) {
-    if (inject(EV_REL, REL_X, x) != OK) {
-        return BAD_VALUE;
-    }
-    return injectSyn(EV_REL, REL_Y, y);
+void InputDevice::movePointer(int32_t x, int32_t y) {
+    inject(EV_REL, REL_X, x);
+    injectSyn(EV_REL, REL_Y, y);
 }
 
-status_t InputDevice::setPointer(int32_t x, int32_t y) {
-    if (inject(EV_ABS, ABS_X, x) != OK) {
-        return BAD_VALUE;
+void InputDevice::setPointer(int32_t x, int32_t y) {
+    inject(EV_ABS, ABS_X, scaleX(x));
+    injectSyn(EV_ABS, ABS_Y, scaleY(y));
+}
+
+int32_t InputDevice::scale(int32_t value, uint32_t size) {
+    if (size == 0) {
+        return 0;
     }
-    return injectSyn(EV_ABS, ABS_Y, y);
+    int64_t scaled = (int64_t)value * kAbsMax / size;
+    return std::max<int64_t>(0, std::min<int64_t>(scaled, kAbsMax));
 }
 
-status_t InputDevice::press(uint16_t code) {
-    return inject(EV_KEY, code, 1);
+void InputDevice::press(uint16_t code) {
+    inject(EV_KEY, code, 1);
 }
 
-status_t InputDevice::release(uint16_t code) {
-    return inject(EV_KEY, code, 0);
+void InputDevice::release(uint16_t code) {
+    inject(EV_KEY, code, 0);
 }
 
-status_t InputDevice::click(uint16_t code) {
-    if (press(code) != OK) {
+void InputDevice::click(uint16_t code) {
+    press(code);
+    release(code);
+}
+
+status_t InputDevice::flush() {
+    if (mBatchCount == 0) {
+        return OK;
+    }
+
+    ATRACE_CALL();
+
+    // one clock read for the whole batch
+    struct timeval now;
+    gettimeofday(&now, 0);
+    for (int i = 0; i < mBatchCount; i++) {
+        mBatch[i].time = now;
+    }
+
+    ssize_t len = sizeof(mBatch[0]) * mBatchCount;
+    mBatchCount = 0;
+
+    if (write(mFD, mBatch, len) != len) {
+        ALOGE("Error: %d (%s)\n", errno, strerror(errno));
         return BAD_VALUE;
     }
-    return release(code);
+    return OK;
 }
 
 void InputDevice::keyEvent(bool down, uint32_t key) {
@@ -205,32 +297,24 @@ void InputDevice::keyEvent(bool down, uint32_t key) {
     if (!mOpened) return;
 
     if ((code = keysym2scancode(key, &sh, &alt))) {
-        int ret = 0;
-
         if (key && down) {
             if (sh) press(42);   // left shift
             if (alt) press(56);  // left alt
 
             inject(EV_SYN, SYN_REPORT, 0);
 
-            ret = press(code);
-            if (ret != 0) {
-                ALOGE("Error: %d (%s)\n", errno, strerror(errno));
-            }
-
+            press(code);
             inject(EV_SYN, SYN_REPORT, 0);
 
-            ret = release(code);
-            if (ret != 0) {
-                ALOGE("Error: %d (%s)\n", errno, strerror(errno));
-            }
-
+            release(code);
             inject(EV_SYN, SYN_REPORT, 0);
 
             if (alt) release(56);  // left alt
             if (sh) release(42);   // left shift
 
             inject(EV_SYN, SYN_REPORT, 0);
+
+            flush();
         }
     }
 }
@@ -241,23 +325,30 @@ void InputDevice::pointerEvent(int buttonMask, int x, int y) {
 
     ALOGV("pointerEvent: buttonMask=%x x=%d y=%d", buttonMask, x, y);
 
-    if ((buttonMask & 1) && mLeftClicked) {  // left btn clicked and moving
-        inject(EV_ABS, ABS_X, x);
-        inject(EV_ABS, ABS_Y, y);
+    if (mMultiTouch) {
+        // the left button drives a single contact
+        if ((buttonMask & 1) || mLeftClicked) {
+            mLeftClicked = buttonMask & 1;
+            TouchContact contact = {0, mLeftClicked, x, y};
+            touchLocked(&contact, 1);
+        }
+    } else if ((buttonMask & 1) && mLeftClicked) {  // left btn clicked and moving
+        inject(EV_ABS, ABS_X, scaleX(x));
+        inject(EV_ABS, ABS_Y, scaleY(y));
         inject(EV_SYN, SYN_REPORT, 0);
 
     } else if (buttonMask & 1) {  // left btn clicked
         mLeftClicked = true;
 
-        inject(EV_ABS, ABS_X, x);
-        inject(EV_ABS, ABS_Y, y);
+        inject(EV_ABS, ABS_X, scaleX(x));
+        inject(EV_ABS, ABS_Y, scaleY(y));
         inject(EV_KEY, BTN_TOUCH, 1);
         inject(EV_SYN, SYN_REPORT, 0);
     } else if (mLeftClicked)  // left btn released
     {
         mLeftClicked = false;
-        inject(EV_ABS, ABS_X, x);
-        inject(EV_ABS, ABS_Y, y);
+        inject(EV_ABS, ABS_X, scaleX(x));
+        inject(EV_ABS, ABS_Y, scaleY(y));
         inject(EV_KEY, BTN_TOUCH, 0);
         inject(EV_SYN, SYN_REPORT, 0);
     }
@@ -295,212 +386,279 @@ void InputDevice::pointerEvent(int buttonMask, int x, int y) {
         inject(EV_REL, REL_WHEEL, -1);
         inject(EV_SYN, SYN_REPORT, 0);
     }
+
+    flush();
 }
 
+void InputDevice::touchLocked(const TouchContact* contacts, int count) {
+    int first = -1;
+
+    for (int i = 0; i < count; i++) {
+        const TouchContact& contact = contacts[i];
+
+        int slot = -1;
+        int freeSlot = -1;
+        for (int s = 0; s < kMaxContacts; s++) {
+            if (mSlots[s] == contact.id) {
+                slot = s;
+                break;
+            }
+            if (freeSlot < 0 && mSlots[s] < 0) {
+                freeSlot = s;
+            }
+        }
+
+        if (slot < 0) {
+            if (!contact.down || freeSlot < 0) {
+                // unknown contact lifted, or too many fingers
+                continue;
+            }
+            slot = freeSlot;
+            mSlots[slot] = contact.id;
+            inject(EV_ABS, ABS_MT_SLOT, slot);
+            inject(EV_ABS, ABS_MT_TRACKING_ID, mNextTrackingId);
+            mNextTrackingId = (mNextTrackingId + 1) & 0xffff;
+        } else {
+            inject(EV_ABS, ABS_MT_SLOT, slot);
+        }
+
+        if (contact.down) {
+            inject(EV_ABS, ABS_MT_POSITION_X, scaleX(contact.x));
+            inject(EV_ABS, ABS_MT_POSITION_Y, scaleY(contact.y));
+            if (first < 0) {
+                first = i;
+            }
+        } else {
+            inject(EV_ABS, ABS_MT_TRACKING_ID, -1);
+            mSlots[slot] = -1;
+        }
+    }
+
+    bool touching = false;
+    for (int s = 0; s < kMaxContacts; s++) {
+        touching |= mSlots[s] >= 0;
+    }
+
+    // single touch emulation for the first contact
+    if (first >= 0) {
+        inject(EV_ABS, ABS_X, scaleX(contacts[first].x));
+        inject(EV_ABS, ABS_Y, scaleY(contacts[first].y));
+    }
+    if (touching != mTouching) {
+        inject(EV_KEY, BTN_TOUCH, touching);
+        mTouching = touching;
+    }
+
+    inject(EV_SYN, SYN_REPORT, 0);
+}
+
+namespace {
+
+enum KeyModifier : uint8_t {
+    kShift = 1 << 0,
+    kAlt = 1 << 1,
+};
+
+struct KeyMapping {
+    uint16_t code;
+    uint8_t modifiers;
+};
+
+// 256 consecutive keysyms
+struct KeyPage {
+    KeyMapping keys[256];
+};
+
+struct SparseKey {
+    uint32_t keysym;
+    KeyMapping key;
+};
+
 // q,w,e,r,t,y,u,i,o,p,a,s,d,f,g,h,j,k,l,z,x,c,v,b,n,m
-static const int qwerty[] = {30, 48, 46, 32, 18, 33, 34, 35, 23, 36, 37, 38, 50,
-                             49, 24, 25, 16, 19, 31, 20, 22, 47, 17, 45, 21, 44};
+constexpr uint16_t qwerty[] = {30, 48, 46, 32, 18, 33, 34, 35, 23, 36, 37, 38, 50,
+                               49, 24, 25, 16, 19, 31, 20, 22, 47, 17, 45, 21, 44};
 // ,!,",#,$,%,&,',(,),*,+,,,-,.,/
-static const int spec1[] = {57, 2, 40, 4, 5, 6, 8, 40, 10, 11, 9, 13, 51, 12, 52, 52};
-static const int spec1sh[] = {0, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 0, 0, 0, 1};
+constexpr uint16_t spec1[] = {57, 2, 40, 4, 5, 6, 8, 40, 10, 11, 9, 13, 51, 12, 52, 52};
+constexpr uint8_t spec1sh[] = {0, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 0, 0, 0, 1};
 // :,;,<,=,>,?,@
-static const int spec2[] = {39, 39, 227, 13, 228, 53, 3};
-static const int spec2sh[] = {1, 0, 1, 1, 1, 1, 1};
+constexpr uint16_t spec2[] = {39, 39, 227, 13, 228, 53, 3};
+constexpr uint8_t spec2sh[] = {1, 0, 1, 1, 1, 1, 1};
 // [,\,],^,_,`
-static const int spec3[] = {26, 43, 27, 7, 12, 399};
-static const int spec3sh[] = {0, 0, 0, 1, 1, 0};
-// {,|,},~
-static const int spec4[] = {26, 43, 27, 215, 14};
-static const int spec4sh[] = {1, 1, 1, 1, 0};
+constexpr uint16_t spec3[] = {26, 43, 27, 7, 12, 399};
+constexpr uint8_t spec3sh[] = {0, 0, 0, 1, 1, 0};
+// {,|,},~,del
+constexpr uint16_t spec4[] = {26, 43, 27, 215, 14};
+constexpr uint8_t spec4sh[] = {1, 1, 1, 1, 0};
+
+constexpr void setKey(KeyPage& page, uint32_t keysym, uint16_t code, uint8_t modifiers = 0) {
+    page.keys[keysym & 0xff].code = code;
+    page.keys[keysym & 0xff].modifiers = modifiers;
+}
+
+// ascii and latin-1 keysyms, which are also their unicode code points
+constexpr KeyPage makeLatin1Page() {
+    KeyPage page = {};
+
+    for (uint32_t c = 'a'; c <= 'z'; c++) {
+        setKey(page, c, qwerty[c - 'a']);
+        setKey(page, c - 'a' + 'A', qwerty[c - 'a'], kShift);
+    }
+    for (uint32_t c = '1'; c <= '9'; c++) {
+        setKey(page, c, c - '1' + 2);
+    }
+    setKey(page, '0', 11);
+    for (uint32_t c = 32; c <= 47; c++) {
+        setKey(page, c, spec1[c - 32], spec1sh[c - 32] ? kShift : 0);
+    }
+    for (uint32_t c = 58; c <= 64; c++) {
+        setKey(page, c, spec2[c - 58], spec2sh[c - 58] ? kShift : 0);
+    }
+    for (uint32_t c = 91; c <= 96; c++) {
+        setKey(page, c, spec3[c - 91], spec3sh[c - 91] ? kShift : 0);
+    }
+    for (uint32_t c = 123; c <= 127; c++) {
+        setKey(page, c, spec4[c - 123], spec4sh[c - 123] ? kShift : 0);
+    }
+
+    setKey(page, 1, 34, kAlt);  // ctrl+a
+    setKey(page, 3, 46, kAlt);  // ctrl+c
+    setKey(page, 4, 32, kAlt);  // ctrl+d
+    setKey(page, 18, 31, kAlt); // ctrl+r
+
+    setKey(page, 225, 48, kAlt);           // a with acute
+    setKey(page, 193, 48, kShift | kAlt);  // A with acute
+    setKey(page, 233, 18, kAlt);           // e with acute
+    setKey(page, 201, 18, kShift | kAlt);  // E with acute
+    setKey(page, 205, 36, kShift | kAlt);  // I with acute
+    setKey(page, 243, 16, kAlt);           // o with acute
+    setKey(page, 211, 16, kShift | kAlt);  // O with acute
+    setKey(page, 246, 25, kAlt);           // o with diaeresis
+    setKey(page, 214, 25, kShift | kAlt);  // O with diaeresis
+    setKey(page, 245, 19, kAlt);           // Hungarian o
+    setKey(page, 213, 19, kShift | kAlt);  // Hungarian O
+    setKey(page, 218, 17, kShift | kAlt);  // U with acute
+    setKey(page, 252, 47, kAlt);           // u with diaeresis
+    setKey(page, 220, 47, kShift | kAlt);  // U with diaeresis
+    setKey(page, 251, 45, kAlt);           // Hungarian u
+    setKey(page, 219, 45, kShift | kAlt);  // Hungarian U
+
+    return page;
+}
+
+// function, cursor and keypad keysyms in 0xff00-0xffff
+constexpr KeyPage makeFunctionPage() {
+    KeyPage page = {};
+
+    setKey(page, 0xff08, 14);        // backspace
+    setKey(page, 0xff09, 15);        // tab
+    setKey(page, 0xff0d, 28);        // enter
+    setKey(page, 0xff1b, 158);       // esc -> back
+    setKey(page, 0xff50, KEY_HOME);  // home
+    setKey(page, 0xff51, 105);       // left -> DPAD_LEFT
+    setKey(page, 0xff52, 103);       // up -> DPAD_UP
+    setKey(page, 0xff53, 106);       // right -> DPAD_RIGHT
+    setKey(page, 0xff54, 108);       // down -> DPAD_DOWN
+    setKey(page, 0xff55, 229);       // PgUp -> menu
+    setKey(page, 0xff56, 61);        // PgDn -> call
+    setKey(page, 0xff57, 107);       // End -> endcall
+    setKey(page, 0xff63, KEY_INSERT);
+    setKey(page, 0xffff, 158);       // del -> back
+
+    setKey(page, 0xff8d, KEY_KPENTER);
+    setKey(page, 0xffaa, KEY_KPASTERISK);
+    setKey(page, 0xffab, KEY_KPPLUS);
+    setKey(page, 0xffad, KEY_KPMINUS);
+    setKey(page, 0xffae, KEY_KPDOT);
+    setKey(page, 0xffaf, KEY_KPSLASH);
+    setKey(page, 0xffb0, KEY_KP0);
+    setKey(page, 0xffb1, KEY_KP1);
+    setKey(page, 0xffb2, KEY_KP2);
+    setKey(page, 0xffb3, KEY_KP3);
+    setKey(page, 0xffb4, KEY_KP4);
+    setKey(page, 0xffb5, KEY_KP5);
+    setKey(page, 0xffb6, KEY_KP6);
+    setKey(page, 0xffb7, KEY_KP7);
+    setKey(page, 0xffb8, KEY_KP8);
+    setKey(page, 0xffb9, KEY_KP9);
+    setKey(page, 0xffbd, KEY_KPEQUAL);
+
+    setKey(page, 0xffbe, KEY_F1);
+    setKey(page, 0xffbf, 36, kAlt);  // i with acute
+    setKey(page, 0xffc0, KEY_F3);
+    setKey(page, 0xffc1, KEY_F4);
+    setKey(page, 0xffc2, 211);       // F5 -> focus
+    setKey(page, 0xffc3, 212);       // F6 -> camera
+    setKey(page, 0xffc4, 150);       // F7 -> explorer
+    setKey(page, 0xffc5, 155);       // F8 -> envelope
+    setKey(page, 0xffc6, KEY_F9);
+    setKey(page, 0xffc7, KEY_F10);
+    setKey(page, 0xffc8, KEY_F11);
+    setKey(page, 0xffc9, KEY_F12);
+    setKey(page, 0xffcf, 127);       // F2 -> search
+    setKey(page, 0xffe3, 127);       // left ctrl -> search
+
+    return page;
+}
+
+constexpr KeyPage kLatin1Keys = makeLatin1Page();
+constexpr KeyPage kFunctionKeys = makeFunctionPage();
+
+// utf-8 encoded accented letters sent by some clients, sorted by keysym
+constexpr SparseKey kUtf8Keys[] = {
+    {50049, {48, kShift | kAlt}},       // A with acute
+    {50057, {18, kShift | kAlt}},       // E with acute
+    {50061, {36, kShift | kAlt}},       // I with acute
+    {50067, {16, kShift | kAlt}},       // O with acute
+    {50070, {25, kShift | kAlt}},       // O with diaeresis
+    {50074, {17, kShift | kAlt}},       // U with acute
+    {50076, {47, kShift | kAlt}},       // U with diaeresis
+    {50081, {48, kAlt}},                // a with acute
+    {50089, {18, kAlt}},                // e with acute
+    {50093, {36, kAlt}},                // i with acute
+    {50099, {16, kAlt}},                // o with acute
+    {50102, {25, kAlt}},                // o with diaeresis
+    {50106, {17, kShift | kAlt}},       // u with acute
+    {50108, {47, kAlt}},                // u with diaeresis
+    {50576, {19, kShift | kAlt}},       // Hungarian O
+    {50577, {19, kAlt}},                // Hungarian o
+    {50608, {45, kShift | kAlt}},       // Hungarian U
+    {50609, {45, kAlt}},                // Hungarian u
+};
+
+// unicode keysyms are the code point plus this offset
+constexpr uint32_t kUnicodeKeysym = 0x01000000;
+
+const KeyMapping* lookupKeysym(uint32_t keysym) {
+    if (keysym >= kUnicodeKeysym && keysym < kUnicodeKeysym + 0x100) {
+        keysym -= kUnicodeKeysym;
+    }
+
+    if (keysym < 0x100) {
+        return &kLatin1Keys.keys[keysym];
+    }
+    if ((keysym & ~0xffu) == 0xff00) {
+        return &kFunctionKeys.keys[keysym & 0xff];
+    }
+
+    const SparseKey* end = kUtf8Keys + sizeof(kUtf8Keys) / sizeof(kUtf8Keys[0]);
+    const SparseKey* key = std::lower_bound(
+        kUtf8Keys, end, keysym,
+        [](const SparseKey& entry, uint32_t value) { return entry.keysym < value; });
+    if (key != end && key->keysym == keysym) {
+        return &key->key;
+    }
+    return nullptr;
+}
+};
 
 int InputDevice::keysym2scancode(uint32_t c, int* sh, int* alt) {
-    int real = 1;
-    if ('a' <= c && c <= 'z') return qwerty[c - 'a'];
-    if ('A' <= c && c <= 'Z') {
-        (*sh) = 1;
-        return qwerty[c - 'A'];
-    }
-    if ('1' <= c && c <= '9') return c - '1' + 2;
-    if (c == '0') return 11;
-    if (32 <= c && c <= 47) {
-        (*sh) = spec1sh[c - 32];
-        return spec1[c - 32];
-    }
-    if (58 <= c && c <= 64) {
-        (*sh) = spec2sh[c - 58];
-        return spec2[c - 58];
-    }
-    if (91 <= c && c <= 96) {
-        (*sh) = spec3sh[c - 91];
-        return spec3[c - 91];
-    }
-    if (123 <= c && c <= 127) {
-        (*sh) = spec4sh[c - 123];
-        return spec4[c - 123];
-    }
-    switch (c) {
-        case 0xff08:
-            return 14;  // backspace
-        case 0xff09:
-            return 15;  // tab
-        case 1:
-            (*alt) = 1;
-            return 34;  // ctrl+a
-        case 3:
-            (*alt) = 1;
-            return 46;  // ctrl+c
-        case 4:
-            (*alt) = 1;
-            return 32;  // ctrl+d
-        case 18:
-            (*alt) = 1;
-            return 31;  // ctrl+r
-        case 0xff0D:
-            return 28;  // enter
-        case 0xff1B:
-            return 158;  // esc -> back
-        case 0xFF51:
-            return 105;  // left -> DPAD_LEFT
-        case 0xFF53:
-            return 106;  // right -> DPAD_RIGHT
-        case 0xFF54:
-            return 108;  // down -> DPAD_DOWN
-        case 0xFF52:
-            return 103;  // up -> DPAD_UP
-        // case 360:
-        //	return 232;// end -> DPAD_CENTER (ball click)
-        case 0xff50:
-            return KEY_HOME;  // home
-        case 0xffff:
-            return 158;  // del -> back
-        case 0xff55:
-            return 229;  // PgUp -> menu
-        case 0xffcf:
-            return 127;  // F2 -> search
-        case 0xffe3:
-            return 127;  // left ctrl -> search
-        case 0xff56:
-            return 61;  // PgUp -> call
-        case 0xff57:
-            return 107;  // End -> endcall
-        case 0xffc2:
-            return 211;  // F5 -> focus
-        case 0xffc3:
-            return 212;  // F6 -> camera
-        case 0xffc4:
-            return 150;  // F7 -> explorer
-        case 0xffc5:
-            return 155;  // F8 -> envelope
-
-        case 50081:
-        case 225:
-            (*alt) = 1;
-            if (real) return 48;  // a with acute
-            return 30;            // a with acute -> a with ring above
-
-        case 50049:
-        case 193:
-            (*sh) = 1;
-            (*alt) = 1;
-            if (real) return 48;  // A with acute
-            return 30;            // A with acute -> a with ring above
-
-        case 50089:
-        case 233:
-            (*alt) = 1;
-            return 18;  // e with acute
-
-        case 50057:
-        case 201:
-            (*sh) = 1;
-            (*alt) = 1;
-            return 18;  // E with acute
-
-        case 50093:
-        case 0xffbf:
-            (*alt) = 1;
-            if (real) return 36;  // i with acute
-            return 23;            // i with acute -> i with grave
-
-        case 50061:
-        case 205:
-            (*sh) = 1;
-            (*alt) = 1;
-            if (real) return 36;  // I with acute
-            return 23;            // I with acute -> i with grave
-
-        case 50099:
-        case 243:
-            (*alt) = 1;
-            if (real) return 16;  // o with acute
-            return 24;            // o with acute -> o with grave
-
-        case 50067:
-        case 211:
-            (*sh) = 1;
-            (*alt) = 1;
-            if (real) return 16;  // O with acute
-            return 24;            // O with acute -> o with grave
-
-        case 50102:
-        case 246:
-            (*alt) = 1;
-            return 25;  // o with diaeresis
-
-        case 50070:
-        case 214:
-            (*sh) = 1;
-            (*alt) = 1;
-            return 25;  // O with diaeresis
-
-        case 50577:
-        case 245:
-            (*alt) = 1;
-            if (real) return 19;  // Hungarian o
-            return 25;            // Hungarian o -> o with diaeresis
-
-        case 50576:
-        case 213:
-            (*sh) = 1;
-            (*alt) = 1;
-            if (real) return 19;  // Hungarian O
-            return 25;            // Hungarian O -> O with diaeresis
-
-        case 50106:
-        // case 0xffbe:
-        //	(*alt)=1;
-        // 	if (real)
-        //		return 17; //u with acute
-        // 	return 22; //u with acute -> u with grave
-        case 50074:
-        case 218:
-            (*sh) = 1;
-            (*alt) = 1;
-            if (real) return 17;  // U with acute
-            return 22;            // U with acute -> u with grave
-        case 50108:
-        case 252:
-            (*alt) = 1;
-            return 47;  // u with diaeresis
-
-        case 50076:
-        case 220:
-            (*sh) = 1;
-            (*alt) = 1;
-            return 47;  // U with diaeresis
-
-        case 50609:
-        case 251:
-            (*alt) = 1;
-            if (real) return 45;  // Hungarian u
-            return 47;            // Hungarian u -> u with diaeresis
-
-        case 50608:
-        case 219:
-            (*sh) = 1;
-            (*alt) = 1;
-            if (real) return 45;  // Hungarian U
-            return 47;            // Hungarian U -> U with diaeresis
-    }
-    return 0;
+    const KeyMapping* key = lookupKeysym(c);
+    if (key == nullptr || key->code == 0) {
+        ALOGV("No scancode for keysym 0x%x", c);
+        return 0;
+    }
+
+    if (key->modifiers & kShift) (*sh) = 1;
+    if (key->modifiers & kAlt) (*alt) = 1;
+    return key->code;
 }
@@ -18,6 +18,9 @@
 #ifndef INPUT_DEVICE_H
 #define INPUT_DEVICE_H
 
+#include <future>
+#include <string>
+
 #include <utils/Errors.h>
 #include <utils/Mutex.h>
 #include <utils/RefBase.h>
@@ -39,21 +42,60 @@ class InputDevice : public RefBase {
     virtual void keyEvent(bool down, uint32_t key);
     virtual void pointerEvent(int buttonMask, int x, int y);
 
-    InputDevice() : mFD(-1) {
+    // name of the uinput device, so an idc file can tie it to a display
+    InputDevice(const char* name = "VNC-RemoteInput")
+        : mFD(-1), mOpened(false), mStarting(false), mWidth(0), mHeight(0), mBatchCount(0),
+          mMultiTouch(false), mName(name) {
     }
     virtual ~InputDevice() {
         stop();
+        if (mStartResult.valid()) {
+            mStartResult.wait();
+        }
     }
 
   private:
 
-    status_t inject(uint16_t type, uint16_t code, int32_t value);
-    status_t injectSyn(uint16_t type, uint16_t code, int32_t value);
-    status_t movePointer(int32_t x, int32_t y);
-    status_t setPointer(int32_t x, int32_t y);
-    status_t press(uint16_t code);
-    status_t release(uint16_t code);
-    status_t click(uint16_t code);
+    static const int kMaxBatch = 32;
+
+    static const int kMaxContacts = 10;
+
+    // one finger of a multi-touch report
+    struct TouchContact {
+        int32_t id;
+        bool down;
+        int32_t x;
+        int32_t y;
+    };
+
+    // range of the absolute axes, independent of the display size
+    static const int32_t kAbsMax = 32767;
+
+    status_t startLocked();
+
+    // display coordinates to the axis range
+    int32_t scale(int32_t value, uint32_t size);
+    int32_t scaleX(int32_t x) {
+        return scale(x, mWidth);
+    }
+    int32_t scaleY(int32_t y) {
+        return scale(y, mHeight);
+    }
+
+    // events are queued and written together by flush()
+    void inject(uint16_t type, uint16_t code, int32_t value);
+    void injectSyn(uint16_t type, uint16_t code, int32_t value);
+    void movePointer(int32_t x, int32_t y);
+    void setPointer(int32_t x, int32_t y);
+    void press(uint16_t code);
+    void release(uint16_t code);
+    void click(uint16_t code);
+
+    // write the queued events with a single syscall
+    status_t flush();
+
+    // MT protocol B slots, called with mLock held
+    void touchLocked(const TouchContact* contacts, int count);
 
     int keysym2scancode(uint32_t c, int* sh, int* alt);
 
@@ -62,8 +104,28 @@ class InputDevice : public RefBase {
     int mFD;
     bool mOpened;
 
+    // an asynchronous start is pending
+    bool mStarting;
+    std::future<status_t> mStartResult;
+
+    // current display size
+    uint32_t mWidth;
+    uint32_t mHeight;
+
     struct uinput_user_dev mUserDev;
 
+    struct input_event mBatch[kMaxBatch];
+    int mBatchCount;
+
+    bool mMultiTouch;
+
+    std::string mName;
+
+    // contact id for each slot, -1 if the slot is unused
+    int32_t mSlots[kMaxContacts];
+    int32_t mNextTrackingId;
+    bool mTouching;
+
     bool mLeftClicked;
     bool mRightClicked;
     bool mMiddleClicked;
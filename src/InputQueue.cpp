@@ -0,0 +1,135 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "VNC-InputQueue"
+#include <utils/Log.h>
+
+#include <unistd.h>
+
+#include <rfb/Configuration.h>
+
+#include "InputQueue.h"
+#include "PerfStats.h"
+
+using namespace vncflinger;
+using namespace android;
+
+static rfb::IntParameter inputRate("inputrate",
+                                   "Maximum number of pointer motion reports injected per second, "
+                                   "0 for no limit",
+                                   120);
+
+InputQueue::InputQueue(const sp<InputDevice>& device)
+    : Thread(false), mDevice(device), mButtonMask(0) {
+}
+
+InputQueue::~InputQueue() {
+}
+
+void InputQueue::keyEvent(bool down, uint32_t key) {
+    PerfStats::get().add(PerfStats::INPUT_EVENTS);
+
+    Event event;
+    event.type = Event::KEY;
+    event.edge = true;
+    event.down = down;
+    event.key = key;
+
+    Mutex::Autolock _l(mLock);
+    queueLocked(event);
+}
+
+void InputQueue::pointerEvent(int buttonMask, int x, int y) {
+    PerfStats::get().add(PerfStats::INPUT_EVENTS);
+
+    Mutex::Autolock _l(mLock);
+
+    bool edge = buttonMask != mButtonMask;
+    mButtonMask = buttonMask;
+
+    // motion only replaces motion, a press or release keeps its position
+    if (!edge && !mEvents.empty()) {
+        Event& last = mEvents.back();
+        if (last.type == Event::POINTER && !last.edge) {
+            last.x = x;
+            last.y = y;
+            return;
+        }
+    }
+
+    Event event;
+    event.type = Event::POINTER;
+    event.edge = edge;
+    event.buttonMask = buttonMask;
+    event.x = x;
+    event.y = y;
+    queueLocked(event);
+}
+
+void InputQueue::queueLocked(const Event& event) {
+    mEvents.push_back(event);
+    mEvents.back().when = systemTime(SYSTEM_TIME_MONOTONIC);
+    mCondition.signal();
+}
+
+void InputQueue::stop() {
+    {
+        Mutex::Autolock _l(mLock);
+        requestExit();
+        mCondition.signal();
+    }
+    join();
+}
+
+bool InputQueue::threadLoop() {
+    std::deque<Event> events;
+
+    {
+        Mutex::Autolock _l(mLock);
+
+        while (!exitPending() && mEvents.empty()) {
+            mCondition.wait(mLock);
+        }
+
+        if (exitPending()) {
+            return false;
+        }
+
+        events.swap(mEvents);
+    }
+
+    bool moved = false;
+    for (const Event& event : events) {
+        if (event.type == Event::KEY) {
+            mDevice->keyEvent(event.down, event.key);
+        } else {
+            mDevice->pointerEvent(event.buttonMask, event.x, event.y);
+            moved = true;
+        }
+
+        PerfStats::get().add(PerfStats::INPUT_INJECTED);
+        PerfStats::get().record(PerfStats::INPUT_LATENCY,
+                                systemTime(SYSTEM_TIME_MONOTONIC) - event.when);
+    }
+
+    // let motion accumulate for one interval before the next report
+    if (moved && inputRate > 0) {
+        usleep(1000000 / inputRate);
+    }
+
+    return true;
+}
@@ -0,0 +1,89 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef INPUT_QUEUE_H
+#define INPUT_QUEUE_H
+
+#include <stdint.h>
+
+#include <deque>
+
+#include <utils/Condition.h>
+#include <utils/Mutex.h>
+#include <utils/Thread.h>
+#include <utils/Timers.h>
+
+#include "InputDevice.h"
+
+using namespace android;
+
+namespace vncflinger {
+
+// Moves input injection off the network thread. Consecutive pointer
+// motion with the same buttons is merged into the latest position,
+// button and key edges are always delivered in order.
+class InputQueue : public Thread {
+  public:
+    InputQueue(const sp<InputDevice>& device);
+
+    virtual ~InputQueue();
+
+    void keyEvent(bool down, uint32_t key);
+    void pointerEvent(int buttonMask, int x, int y);
+
+    void stop();
+
+  private:
+    struct Event {
+        enum Type { KEY, POINTER };
+
+        Type type;
+
+        // when the first event merged into this one arrived
+        nsecs_t when;
+
+        // POINTER, the buttons changed since the event queued before it,
+        // so its position is never overwritten
+        bool edge;
+
+        // KEY
+        bool down;
+        uint32_t key;
+
+        // POINTER
+        int buttonMask;
+        int x;
+        int y;
+    };
+
+    virtual bool threadLoop();
+
+    void queueLocked(const Event& event);
+
+    sp<InputDevice> mDevice;
+
+    Mutex mLock;
+    Condition mCondition;
+
+    std::deque<Event> mEvents;
+
+    // buttons of the last pointer event queued
+    int mButtonMask;
+};
+};
+
+#endif
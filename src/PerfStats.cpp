@@ -0,0 +1,133 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "PerfStats"
+#include <utils/Log.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "PerfStats.h"
+
+using namespace vncflinger;
+
+static const char* const kStageNames[] = {
+    "lock_buffer", "diff", "present", "timers", "backlog_flush", "input_latency", "first_frame",
+};
+
+static const char* const kCounterNames[] = {
+    "frames_captured", "frames_dropped", "frames_presented",
+    "bytes_sent",      "input_events",   "input_injected",
+};
+
+PerfStats& PerfStats::get() {
+    static PerfStats sStats;
+    return sStats;
+}
+
+PerfStats::PerfStats() {
+    for (Histogram& h : mStages) {
+        h.sum = 0;
+        h.max = 0;
+        for (std::atomic<uint64_t>& b : h.buckets) {
+            b = 0;
+        }
+    }
+    for (std::atomic<uint64_t>& c : mCounters) {
+        c = 0;
+    }
+}
+
+void PerfStats::record(Stage stage, nsecs_t duration) {
+    uint64_t us = duration > 0 ? (uint64_t)ns2us(duration) : 0;
+
+    int bucket = 0;
+    while (bucket < kBuckets - 1 && (us >> bucket) != 0) {
+        bucket++;
+    }
+
+    Histogram& h = mStages[stage];
+    h.sum.fetch_add(us, std::memory_order_relaxed);
+    h.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t max = h.max.load(std::memory_order_relaxed);
+    while (us > max && !h.max.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+    }
+}
+
+uint64_t PerfStats::percentile(const uint64_t* buckets, uint64_t count, double fraction) {
+    uint64_t target = (uint64_t)(count * fraction);
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+        seen += buckets[i];
+        if (seen > target) {
+            return (uint64_t)1 << i;
+        }
+    }
+    return (uint64_t)1 << (kBuckets - 1);
+}
+
+void PerfStats::setClientBytes(int client, uint64_t sent) {
+    android::Mutex::Autolock _l(mClientLock);
+    mClientBytes[client] = sent;
+}
+
+void PerfStats::removeClient(int client) {
+    android::Mutex::Autolock _l(mClientLock);
+    mClientBytes.erase(client);
+}
+
+std::string PerfStats::dump() {
+    std::string out;
+    char line[256];
+
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        Histogram& h = mStages[s];
+
+        // not an atomic snapshot, but close enough for monitoring
+        uint64_t buckets[kBuckets];
+        uint64_t total = 0;
+        for (int i = 0; i < kBuckets; i++) {
+            buckets[i] = h.buckets[i].load(std::memory_order_relaxed);
+            total += buckets[i];
+        }
+        uint64_t sum = h.sum.load(std::memory_order_relaxed);
+
+        snprintf(line, sizeof(line),
+                 "%s count=%" PRIu64 " avg_us=%" PRIu64 " max_us=%" PRIu64 " p50_us<%" PRIu64
+                 " p90_us<%" PRIu64 " p99_us<%" PRIu64 "\n",
+                 kStageNames[s], total, total ? sum / total : 0,
+                 h.max.load(std::memory_order_relaxed), percentile(buckets, total, 0.5),
+                 percentile(buckets, total, 0.9), percentile(buckets, total, 0.99));
+        out += line;
+    }
+
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        snprintf(line, sizeof(line), "%s %" PRIu64 "\n", kCounterNames[c],
+                 mCounters[c].load(std::memory_order_relaxed));
+        out += line;
+    }
+
+    android::Mutex::Autolock _l(mClientLock);
+    for (const auto& client : mClientBytes) {
+        snprintf(line, sizeof(line), "client fd=%d bytes_sent=%" PRIu64 "\n", client.first,
+                 client.second);
+        out += line;
+    }
+
+    return out;
+}
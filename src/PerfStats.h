@@ -0,0 +1,111 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef PERF_STATS_H
+#define PERF_STATS_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <string>
+
+#include <utils/Mutex.h>
+#include <utils/Timers.h>
+
+namespace vncflinger {
+
+// Lock-free counters and latency histograms for the capture, server and
+// input paths. Cheap enough to stay on in release builds, a snapshot can
+// be read from the vncflinger-stats socket.
+class PerfStats {
+  public:
+    enum Stage {
+        LOCK_BUFFER,    // CpuConsumer::lockNextBuffer
+        DIFF,           // compare and copy into the back buffer
+        PRESENT,        // processFrames on the server thread
+        TIMERS,         // all rfb timers: encoding updates, and the desktop's polls
+        BACKLOG_FLUSH,  // flushing a client's queued output on EPOLLOUT
+        INPUT_LATENCY,  // client event received to uinput write
+        FIRST_FRAME,    // desktop started to its first frame presented
+        STAGE_COUNT
+    };
+
+    enum Counter {
+        FRAMES_CAPTURED,
+        FRAMES_DROPPED,
+        FRAMES_PRESENTED,
+        BYTES_SENT,
+        INPUT_EVENTS,
+        INPUT_INJECTED,
+        COUNTER_COUNT
+    };
+
+    static PerfStats& get();
+
+    void record(Stage stage, nsecs_t duration);
+
+    void add(Counter counter, uint64_t value = 1) {
+        mCounters[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // bytes handed to a client's socket so far, keyed by its fd. only
+    // called from the server thread, so unlike the rest this takes a lock
+    void setClientBytes(int client, uint64_t sent);
+    void removeClient(int client);
+
+    // one line per stage, counter and client
+    std::string dump();
+
+    // records the lifetime of the object
+    class ScopedTimer {
+      public:
+        ScopedTimer(Stage stage) : mStage(stage), mStart(systemTime(SYSTEM_TIME_MONOTONIC)) {
+        }
+        ~ScopedTimer() {
+            PerfStats::get().record(mStage, systemTime(SYSTEM_TIME_MONOTONIC) - mStart);
+        }
+
+      private:
+        Stage mStage;
+        nsecs_t mStart;
+    };
+
+  private:
+    // bucket n counts durations below 2^n us
+    static const int kBuckets = 32;
+
+    struct Histogram {
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+        std::atomic<uint64_t> buckets[kBuckets];
+    };
+
+    PerfStats();
+
+    // upper bound of the bucket containing the given fraction of samples
+    static uint64_t percentile(const uint64_t* buckets, uint64_t count, double fraction);
+
+    Histogram mStages[STAGE_COUNT];
+    std::atomic<uint64_t> mCounters[COUNTER_COUNT];
+
+    android::Mutex mClientLock;
+    std::map<int, uint64_t> mClientBytes;
+};
+};
+
+#endif
@@ -0,0 +1,154 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "ScrollDetector"
+#include <utils/Log.h>
+
+#include <string.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "ScrollDetector.h"
+
+using namespace vncflinger;
+
+uint64_t ScrollDetector::hashRow(const uint8_t* row, size_t len) {
+    // fnv-1a over 64-bit words, rows are read from the cached copy
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, row, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        row += sizeof(word);
+    }
+    for (; len > 0; len--) {
+        hash = (hash ^ *row++) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+void ScrollDetector::reset() {
+    mHashes.clear();
+    mWidth = mHeight = 0;
+}
+
+bool ScrollDetector::update(const uint8_t* frame, int width, int height, int stride,
+                            int bytesPerPixel, const rfb::Region& changed, rfb::Rect* dest,
+                            int* dy) {
+    const size_t pitch = (size_t)stride * bytesPerPixel;
+    const size_t rowLen = (size_t)width * bytesPerPixel;
+
+    if (width != mWidth || height != mHeight) {
+        mWidth = width;
+        mHeight = height;
+        mHashes.resize(height);
+        for (int y = 0; y < height; y++) {
+            mHashes[y] = hashRow(frame + y * pitch, rowLen);
+        }
+        return false;
+    }
+
+    std::vector<rfb::Rect> rects;
+    changed.get_rects(&rects);
+
+    std::vector<uint8_t> rowChanged(height);
+    int changedRows = 0;
+    for (const rfb::Rect& r : rects) {
+        for (int y = std::max(0, r.tl.y); y < std::min(height, r.br.y); y++) {
+            changedRows += !rowChanged[y];
+            rowChanged[y] = 1;
+        }
+    }
+
+    if (changedRows < kMinScrollRows) {
+        for (int y = 0; y < height; y++) {
+            if (rowChanged[y]) {
+                mHashes[y] = hashRow(frame + y * pitch, rowLen);
+            }
+        }
+        return false;
+    }
+
+    std::vector<uint64_t> previous(mHashes);
+    for (int y = 0; y < height; y++) {
+        if (rowChanged[y]) {
+            mHashes[y] = hashRow(frame + y * pitch, rowLen);
+        }
+    }
+
+    // rows of the previous frame by hash, repeated content (blank rows,
+    // list dividers) can't tell us where anything went
+    std::unordered_map<uint64_t, int> rows;
+    rows.reserve(height);
+    for (int y = 0; y < height; y++) {
+        auto it = rows.emplace(previous[y], y);
+        if (!it.second) {
+            it.first->second = -1;
+        }
+    }
+
+    // every changed row votes for the distance it moved
+    std::unordered_map<int, int> votes;
+    int best = 0, bestVotes = 0;
+    for (int y = 1; y < height; y++) {
+        if (!rowChanged[y] || mHashes[y] == mHashes[y - 1]) {
+            continue;
+        }
+        auto it = rows.find(mHashes[y]);
+        if (it == rows.end() || it->second < 0 || it->second == y) {
+            continue;
+        }
+        int move = y - it->second;
+        int count = ++votes[move];
+        if (count > bestVotes) {
+            best = move;
+            bestVotes = count;
+        }
+    }
+
+    if (bestVotes < kMinVotes) {
+        return false;
+    }
+
+    // the longest run of rows which all moved by the winning distance
+    int runStart = -1, bestStart = 0, bestEnd = 0;
+    int first = std::max(0, best), last = std::min(height, height + best);
+    for (int y = first; y <= last; y++) {
+        bool moved = y < last && mHashes[y] == previous[y - best];
+        if (moved && runStart < 0) {
+            runStart = y;
+        } else if (!moved && runStart >= 0) {
+            if (y - runStart > bestEnd - bestStart) {
+                bestStart = runStart;
+                bestEnd = y;
+            }
+            runStart = -1;
+        }
+    }
+
+    if (bestEnd - bestStart < kMinScrollRows) {
+        return false;
+    }
+
+    *dest = rfb::Rect(0, bestStart, width, bestEnd);
+    *dy = best;
+
+    ALOGV("Scroll of %d rows detected in [%d, %d)", best, bestStart, bestEnd);
+    return true;
+}
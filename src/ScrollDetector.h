@@ -0,0 +1,60 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef SCROLL_DETECTOR_H
+#define SCROLL_DETECTOR_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <rfb/Rect.h>
+#include <rfb/Region.h>
+
+namespace vncflinger {
+
+// Finds rows of the previous frame which moved up or down, so a scroll
+// can be sent as a copy plus the newly exposed strip. Keeps a hash of
+// every row of the last frame, only rows which changed are rehashed.
+class ScrollDetector {
+  public:
+    // rows which have to move together to be worth a copy
+    static const int kMinScrollRows = 64;
+
+    ScrollDetector() : mWidth(0), mHeight(0) {
+    }
+
+    // update the hashes for a new frame, and return true if the changed
+    // rows contain a move. dest is where the rows are now, they were dy
+    // rows higher up in the previous frame. stride is in pixels.
+    bool update(const uint8_t* frame, int width, int height, int stride, int bytesPerPixel,
+                const rfb::Region& changed, rfb::Rect* dest, int* dy);
+
+    // forget the previous frame
+    void reset();
+
+  private:
+    static const int kMinVotes = 16;
+
+    static uint64_t hashRow(const uint8_t* row, size_t len);
+
+    std::vector<uint64_t> mHashes;
+    int mWidth, mHeight;
+};
+};
+
+#endif
@@ -0,0 +1,124 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "TileDiff"
+#include <utils/Log.h>
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "CompareCopy.h"
+#include "TileDiff.h"
+
+using namespace vncflinger;
+
+void TileDiff::setTileSize(int size) {
+    if (size < kMinTileSize) {
+        size = kMinTileSize;
+    } else if (size > kMaxTileSize) {
+        size = kMaxTileSize;
+    }
+
+    if (size != mTileSize) {
+        ALOGV("Tile size changed: old=%d new=%d", mTileSize, size);
+        mTileSize = size;
+    }
+}
+
+void TileDiff::process(const rfb::Rect& rect, uint8_t* dst, int dstStride, const uint8_t* src,
+                       int srcStride, int bytesPerPixel, rfb::Region* damage) {
+    if (rect.is_empty()) {
+        return;
+    }
+
+    int bands = (rect.height() + mTileSize - 1) / mTileSize;
+
+    if (mPool == nullptr || mPool->getThreads() < 2 || bands < 2) {
+        processBands(rect, 0, bands, dst, dstStride, src, srcStride, bytesPerPixel, damage);
+        return;
+    }
+
+    // bands don't overlap, so each job only needs its own damage
+    int jobs = std::min(bands, mPool->getThreads());
+    std::vector<rfb::Region> damages(jobs);
+
+    mPool->run(jobs, [&](int job) {
+        processBands(rect, bands * job / jobs, bands * (job + 1) / jobs, dst, dstStride, src,
+                     srcStride, bytesPerPixel, &damages[job]);
+    });
+
+    for (const rfb::Region& d : damages) {
+        damage->assign_union(d);
+    }
+}
+
+void TileDiff::processBands(const rfb::Rect& rect, int first, int last, uint8_t* dst,
+                            int dstStride, const uint8_t* src, int srcStride, int bytesPerPixel,
+                            rfb::Region* damage) {
+    const size_t dstPitch = (size_t)dstStride * bytesPerPixel;
+    const size_t srcPitch = (size_t)srcStride * bytesPerPixel;
+    const size_t tileBytes = (size_t)mTileSize * bytesPerPixel;
+
+    CompareCopyFn compareCopy = CompareCopy::get();
+
+    int columns = (rect.width() + mTileSize - 1) / mTileSize;
+    size_t lastBytes = (size_t)(rect.width() - (columns - 1) * mTileSize) * bytesPerPixel;
+
+    // changed bits for the tiles in the current band
+    std::vector<uint8_t> dirty(columns);
+
+    for (int band = first; band < last; band++) {
+        int ty = rect.tl.y + band * mTileSize;
+        int rows = std::min(mTileSize, rect.br.y - ty);
+
+        std::fill(dirty.begin(), dirty.end(), 0);
+
+        // walk the band row by row so the source is streamed
+        // sequentially, each row segment sets the bit of its tile
+        for (int y = ty; y < ty + rows; y++) {
+            uint8_t* d = dst + (size_t)y * dstPitch + (size_t)rect.tl.x * bytesPerPixel;
+            const uint8_t* s = src + (size_t)y * srcPitch + (size_t)rect.tl.x * bytesPerPixel;
+
+            for (int c = 0; c < columns; c++) {
+                size_t len = (c == columns - 1) ? lastBytes : tileBytes;
+                dirty[c] |= compareCopy(d, s, len);
+                d += len;
+                s += len;
+            }
+        }
+
+        // horizontally adjacent dirty tiles are merged into a single
+        // rect to keep the region small
+        int runStart = -1;
+
+        for (int c = 0; c < columns; c++) {
+            if (dirty[c] && runStart < 0) {
+                runStart = c;
+            } else if (!dirty[c] && runStart >= 0) {
+                damage->assign_union(rfb::Region(rfb::Rect(rect.tl.x + runStart * mTileSize, ty,
+                                                           rect.tl.x + c * mTileSize, ty + rows)));
+                runStart = -1;
+            }
+        }
+
+        if (runStart >= 0) {
+            damage->assign_union(rfb::Region(
+                rfb::Rect(rect.tl.x + runStart * mTileSize, ty, rect.br.x, ty + rows)));
+        }
+    }
+}
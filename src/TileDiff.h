@@ -0,0 +1,80 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef TILE_DIFF_H
+#define TILE_DIFF_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <utils/StrongPointer.h>
+
+#include <rfb/Rect.h>
+#include <rfb/Region.h>
+
+#include "WorkerPool.h"
+
+namespace vncflinger {
+
+// Splits a frame into square tiles and compares each one against the
+// previous frame, so that only the areas which actually changed are
+// copied and reported to the server.
+class TileDiff {
+  public:
+    static const int kDefaultTileSize = 64;
+    static const int kMinTileSize = 16;
+    static const int kMaxTileSize = 256;
+
+    TileDiff() : mTileSize(kDefaultTileSize) {
+    }
+
+    void setTileSize(int size);
+
+    // bands of tiles are split across the pool when it has more than one thread
+    void setWorkerPool(const sp<WorkerPool>& pool) {
+        mPool = pool;
+    }
+
+    int getTileSize() const {
+        return mTileSize;
+    }
+
+    // grows rect outwards to the tile grid
+    rfb::Rect alignToTiles(const rfb::Rect& rect) const {
+        return rfb::Rect(rect.tl.x - rect.tl.x % mTileSize, rect.tl.y - rect.tl.y % mTileSize,
+                         rect.br.x + (mTileSize - rect.br.x % mTileSize) % mTileSize,
+                         rect.br.y + (mTileSize - rect.br.y % mTileSize) % mTileSize);
+    }
+
+    // copies src into dst inside rect and adds every tile that
+    // differed to damage. strides are in pixels.
+    void process(const rfb::Rect& rect, uint8_t* dst, int dstStride, const uint8_t* src,
+                 int srcStride, int bytesPerPixel, rfb::Region* damage);
+
+  private:
+    // diff the bands [first, last) of rect
+    void processBands(const rfb::Rect& rect, int first, int last, uint8_t* dst, int dstStride,
+                      const uint8_t* src, int srcStride, int bytesPerPixel, rfb::Region* damage);
+
+    int mTileSize;
+
+    sp<WorkerPool> mPool;
+};
+};
+
+#endif
@@ -0,0 +1,174 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "TileMatcher"
+#include <utils/Log.h>
+
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+
+#include "TileMatcher.h"
+
+using namespace vncflinger;
+
+void TileMatcher::reset() {
+    mHashes.clear();
+    mWidth = mHeight = 0;
+    mColumns = mRows = 0;
+}
+
+rfb::Rect TileMatcher::tileRect(int index) const {
+    int x = (index % mColumns) * kTileSize;
+    int y = (index / mColumns) * kTileSize;
+    return rfb::Rect(x, y, std::min(x + kTileSize, mWidth), std::min(y + kTileSize, mHeight));
+}
+
+uint64_t TileMatcher::hashTile(const uint8_t* frame, size_t pitch, int bytesPerPixel,
+                               int index) const {
+    rfb::Rect r = tileRect(index);
+    size_t len = (size_t)r.width() * bytesPerPixel;
+
+    // fnv-1a over 64-bit words, the size is part of the hash so partial
+    // tiles on the edges only match each other
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = (hash ^ (uint64_t)(r.width() << 16 | r.height())) * 0x100000001b3ULL;
+
+    for (int y = r.tl.y; y < r.br.y; y++) {
+        const uint8_t* p = frame + y * pitch + (size_t)r.tl.x * bytesPerPixel;
+        size_t left = len;
+        for (; left >= sizeof(uint64_t); left -= sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, p, sizeof(word));
+            hash = (hash ^ word) * 0x100000001b3ULL;
+            p += sizeof(word);
+        }
+        for (; left > 0; left--) {
+            hash = (hash ^ *p++) * 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+bool TileMatcher::update(const uint8_t* frame, int width, int height, int stride,
+                         int bytesPerPixel, const rfb::Region& changed, rfb::Region* copied,
+                         rfb::Point* delta) {
+    const size_t pitch = (size_t)stride * bytesPerPixel;
+
+    if (width != mWidth || height != mHeight) {
+        mWidth = width;
+        mHeight = height;
+        mColumns = (width + kTileSize - 1) / kTileSize;
+        mRows = (height + kTileSize - 1) / kTileSize;
+        mHashes.resize(mColumns * mRows);
+        for (int i = 0; i < (int)mHashes.size(); i++) {
+            mHashes[i] = hashTile(frame, pitch, bytesPerPixel, i);
+        }
+        return false;
+    }
+
+    std::vector<rfb::Rect> rects;
+    changed.get_rects(&rects);
+
+    std::vector<int> tiles;
+    std::vector<uint8_t> tileChanged(mHashes.size());
+    for (const rfb::Rect& r : rects) {
+        int x0 = std::max(0, r.tl.x) / kTileSize;
+        int y0 = std::max(0, r.tl.y) / kTileSize;
+        int x1 = (std::min(width, r.br.x) + kTileSize - 1) / kTileSize;
+        int y1 = (std::min(height, r.br.y) + kTileSize - 1) / kTileSize;
+        for (int ty = y0; ty < y1; ty++) {
+            for (int tx = x0; tx < x1; tx++) {
+                int i = ty * mColumns + tx;
+                if (!tileChanged[i]) {
+                    tileChanged[i] = 1;
+                    tiles.push_back(i);
+                }
+            }
+        }
+    }
+
+    if ((int)tiles.size() < kMinTiles) {
+        for (int i : tiles) {
+            mHashes[i] = hashTile(frame, pitch, bytesPerPixel, i);
+        }
+        return false;
+    }
+
+    std::vector<uint64_t> previous(mHashes);
+    for (int i : tiles) {
+        mHashes[i] = hashTile(frame, pitch, bytesPerPixel, i);
+    }
+
+    // tiles of the previous frame by hash, repeated content like a plain
+    // background can't tell us where anything came from
+    std::unordered_map<uint64_t, int> sources;
+    sources.reserve(previous.size());
+    for (int i = 0; i < (int)previous.size(); i++) {
+        auto it = sources.emplace(previous[i], i);
+        if (!it.second) {
+            it.first->second = -1;
+        }
+    }
+
+    // each moved tile votes for its offset, clients can only take a
+    // single copy delta per update
+    std::map<std::pair<int, int>, int> votes;
+    std::pair<int, int> best;
+    int bestVotes = 0;
+    for (int i : tiles) {
+        if (mHashes[i] == previous[i]) {
+            continue;
+        }
+        auto it = sources.find(mHashes[i]);
+        if (it == sources.end() || it->second < 0) {
+            continue;
+        }
+        rfb::Rect to = tileRect(i), from = tileRect(it->second);
+        std::pair<int, int> move(to.tl.x - from.tl.x, to.tl.y - from.tl.y);
+        int count = ++votes[move];
+        if (count > bestVotes) {
+            best = move;
+            bestVotes = count;
+        }
+    }
+
+    if (bestVotes < kMinTiles) {
+        return false;
+    }
+
+    copied->clear();
+    for (int i : tiles) {
+        if (mHashes[i] == previous[i]) {
+            continue;
+        }
+        auto it = sources.find(mHashes[i]);
+        if (it == sources.end() || it->second < 0) {
+            continue;
+        }
+        rfb::Rect to = tileRect(i), from = tileRect(it->second);
+        if (to.tl.x - from.tl.x == best.first && to.tl.y - from.tl.y == best.second) {
+            copied->assign_union(rfb::Region(to));
+        }
+    }
+    *delta = rfb::Point(best.first, best.second);
+
+    ALOGV("%d tiles moved by (%d, %d)", bestVotes, best.first, best.second);
+    return true;
+}
@@ -0,0 +1,64 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef TILE_MATCHER_H
+#define TILE_MATCHER_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <rfb/Rect.h>
+#include <rfb/Region.h>
+
+namespace vncflinger {
+
+// Finds changed tiles whose contents were somewhere else on the previous
+// frame, like cards in the app switcher, so clients can copy them from
+// what they already show. Keeps a hash of every tile of the last frame,
+// only tiles which changed are rehashed.
+class TileMatcher {
+  public:
+    static const int kTileSize = 64;
+
+    TileMatcher() : mWidth(0), mHeight(0), mColumns(0), mRows(0) {
+    }
+
+    // update the hashes for a new frame, and return true if some of the
+    // changed tiles moved by the same delta. copied is where they are now,
+    // they were at copied - delta in the previous frame. stride is in pixels.
+    bool update(const uint8_t* frame, int width, int height, int stride, int bytesPerPixel,
+                const rfb::Region& changed, rfb::Region* copied, rfb::Point* delta);
+
+    // forget the previous frame
+    void reset();
+
+  private:
+    // tiles which have to move together to be worth a copy
+    static const int kMinTiles = 4;
+
+    rfb::Rect tileRect(int index) const;
+
+    uint64_t hashTile(const uint8_t* frame, size_t pitch, int bytesPerPixel, int index) const;
+
+    std::vector<uint64_t> mHashes;
+    int mWidth, mHeight;
+    int mColumns, mRows;
+};
+};
+
+#endif
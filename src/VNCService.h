@@ -1,50 +1,132 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef VNC_SERVICE_H
+#define VNC_SERVICE_H
+
+#include <stdio.h>
+
+#include <binder/Status.h>
+#include <utils/String16.h>
+#include <utils/String8.h>
+
+#include <rfb/Configuration.h>
+
 #include "org/chemlab/BnVNCService.h"
 
-#include "VNCFlinger.h"
+#include "AndroidDesktop.h"
+#include "PerfStats.h"
 
-namespace android {
+namespace vncflinger {
 
+// Binder control interface, lets a management agent retune a running
+// server. Parameters are changed in place and picked up by the capture
+// and server threads, connected clients stay connected.
 class VNCService : public org::chemlab::BnVNCService {
+  public:
+    VNCService(const sp<AndroidDesktop>& desktop) : mDesktop(desktop) {
+    }
+
+    binder::Status setParameter(const String16& name, const String16& value, bool* ret) {
+        *ret = set(String8(name).string(), String8(value).string());
+        return binder::Status::ok();
+    }
 
-public:
-    VNCService(sp<VNCFlinger> flinger) : mVNC(flinger) {}
+    binder::Status getParameter(const String16& name, String16* ret) {
+        rfb::VoidParameter* param = rfb::Configuration::getParam(String8(name).string());
+        if (!isTunable(param)) {
+            *ret = String16();
+            return binder::Status::ok();
+        }
 
-    binder::Status start(bool* ret) {
-        *ret = mVNC->start();
+        char* value = param->getValueStr();
+        *ret = String16(value);
+        delete[] value;
         return binder::Status::ok();
     }
 
-    binder::Status stop(bool* ret) {
-        *ret = mVNC->stop() == NO_ERROR;
+    binder::Status setFrameRate(int32_t fps, bool* ret) {
+        *ret = fps > 0 && set("capturerate", fps);
         return binder::Status::ok();
     }
 
-    binder::Status setPort(int32_t port, bool* ret) {
-        *ret = mVNC->setPort(port) == NO_ERROR;
+    binder::Status setCaptureDepth(int32_t depth, bool* ret) {
+        *ret = (depth == 16 || depth == 32) && set("capturedepth", depth);
         return binder::Status::ok();
     }
 
-    binder::Status setV4Address(const String16& addr, bool* ret) {
-        *ret = mVNC->setV4Address(String8(addr)) == NO_ERROR;
+    binder::Status setCaptureThreads(int32_t threads, bool* ret) {
+        *ret = threads > 0 && set("capturethreads", threads);
         return binder::Status::ok();
     }
 
-    binder::Status setV6Address(const String16& addr, bool* ret) {
-        *ret = mVNC->setV6Address(String8(addr)) == NO_ERROR;
+    binder::Status setCaptureScale(int32_t percent, bool* ret) {
+        *ret = percent >= 10 && percent <= 100 && set("capturescale", percent);
         return binder::Status::ok();
     }
 
-    binder::Status setPassword(const String16& addr, bool* ret) {
-        *ret = mVNC->setPassword(String8(addr)) == NO_ERROR;
+    binder::Status setViewport(int32_t left, int32_t top, int32_t right, int32_t bottom,
+                               bool* ret) {
+        Rect viewport(left, top, right, bottom);
+        *ret = (left == 0 && top == 0 && right == 0 && bottom == 0) ||
+               (left >= 0 && top >= 0 && viewport.isValid() && !viewport.isEmpty());
+        if (*ret) {
+            mDesktop->setViewport(viewport);
+        }
         return binder::Status::ok();
     }
 
-    binder::Status clearPassword(bool* ret) {
-        *ret = mVNC->clearPassword() == NO_ERROR;
+    binder::Status getStats(String16* ret) {
+        *ret = String16(PerfStats::get().dump().c_str());
         return binder::Status::ok();
     }
 
-private:
-    sp<VNCFlinger> mVNC;
+  private:
+    // only plain numbers and switches are exposed, strings and binary
+    // data like the password are read without locking and stay with the
+    // command line
+    static bool isTunable(rfb::VoidParameter* param) {
+        return dynamic_cast<rfb::IntParameter*>(param) != nullptr ||
+               dynamic_cast<rfb::BoolParameter*>(param) != nullptr;
+    }
+
+    bool set(const char* name, int value) {
+        char str[16];
+        snprintf(str, sizeof(str), "%d", value);
+        return set(name, str);
+    }
+
+    bool set(const char* name, const char* value) {
+        rfb::VoidParameter* param = rfb::Configuration::getParam(name);
+        if (!isTunable(param)) {
+            return false;
+        }
+
+        if (!param->setParam(value)) {
+            return false;
+        }
+
+        ALOGI("Parameter %s set to %s", name, value);
+        mDesktop->onParametersChanged();
+        return true;
+    }
+
+    sp<AndroidDesktop> mDesktop;
 };
 };
+
+#endif
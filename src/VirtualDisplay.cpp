@@ -18,35 +18,52 @@
 #define LOG_TAG "VirtualDisplay"
 #include <utils/Log.h>
 
+#include <algorithm>
+
 #include <gui/BufferQueue.h>
 #include <gui/CpuConsumer.h>
 #include <gui/IGraphicBufferConsumer.h>
 #include <gui/SurfaceComposerClient.h>
 
+#include <rfb/Configuration.h>
+
 #include "VirtualDisplay.h"
 
 using namespace vncflinger;
 
-VirtualDisplay::VirtualDisplay(DisplayInfo* info, uint32_t width, uint32_t height,
-                               sp<CpuConsumer::FrameAvailableListener> listener) {
+static rfb::IntParameter queueDepth("queuedepth",
+                                    "Number of buffers the compositor can dequeue at once", 4);
+static rfb::IntParameter acquiredBuffers(
+    "acquiredbuffers", "Number of buffers the capture thread can hold at once", 1);
+static rfb::BoolParameter latestFrame(
+    "latestframe", "Replace queued buffers with newer ones instead of capturing each", false);
+
+VirtualDisplay::VirtualDisplay(DisplayInfo* info, const Rect& viewport, uint32_t width,
+                               uint32_t height, PixelFormat format, uint32_t layerStack,
+                               sp<CpuConsumer::FrameAvailableListener> listener)
+    : mFormat(format), mPaused(false) {
     mWidth = width;
     mHeight = height;
 
-    if (info->orientation == DISPLAY_ORIENTATION_0 || info->orientation == DISPLAY_ORIENTATION_180) {
-        mSourceRect = Rect(info->w, info->h);
-    } else {
-        mSourceRect = Rect(info->h, info->w);
-    }
+    updateSourceRect(info, viewport);
 
     Rect displayRect = getDisplayRect();
 
-    sp<IGraphicBufferConsumer> consumer;
-    BufferQueue::createBufferQueue(&mProducer, &consumer);
-    mCpuConsumer = new CpuConsumer(consumer, 1);
+    mMaxAcquiredBuffers = std::max((int)acquiredBuffers, 1);
+
+    BufferQueue::createBufferQueue(&mProducer, &mConsumer);
+    // one spare so the capture thread can lock ahead when draining
+    mCpuConsumer = new CpuConsumer(mConsumer, mMaxAcquiredBuffers + 1);
     mCpuConsumer->setName(String8("vds-to-cpu"));
     mCpuConsumer->setDefaultBufferSize(width, height);
-    mProducer->setMaxDequeuedBufferCount(4);
-    consumer->setDefaultBufferFormat(PIXEL_FORMAT_RGBX_8888);
+    mProducer->setMaxDequeuedBufferCount(std::max((int)queueDepth, 1));
+    // the compositor never waits for us, a new frame drops the queued one
+    if (latestFrame) {
+        mProducer->setAsyncMode(true);
+    }
+    // scaling to the buffer size and reducing the depth both happen
+    // on the gpu while the display is composited
+    mConsumer->setDefaultBufferFormat(format);
 
     mCpuConsumer->setFrameAvailableListener(listener);
 
@@ -56,21 +73,92 @@ VirtualDisplay::VirtualDisplay(DisplayInfo* info, uint32_t width, uint32_t heigh
     SurfaceComposerClient::setDisplaySurface(mDpy, mProducer);
 
     SurfaceComposerClient::setDisplayProjection(mDpy, 0, mSourceRect, displayRect);
-    SurfaceComposerClient::setDisplayLayerStack(mDpy, 0);  // default stack
+    SurfaceComposerClient::setDisplayLayerStack(mDpy, layerStack);
     SurfaceComposerClient::closeGlobalTransaction();
 
-    ALOGV("Virtual display (%ux%u [viewport=%ux%u] created", width, height, displayRect.getWidth(),
-          displayRect.getHeight());
+    ALOGV("Virtual display (%ux%u [viewport=%ux%u] format=%d) created", width, height,
+          displayRect.getWidth(), displayRect.getHeight(), format);
 }
 
 VirtualDisplay::~VirtualDisplay() {
     mCpuConsumer.clear();
+    mConsumer.clear();
     mProducer.clear();
     SurfaceComposerClient::destroyDisplay(mDpy);
 
     ALOGV("Virtual display destroyed");
 }
 
+status_t VirtualDisplay::reconfigure(DisplayInfo* info, const Rect& viewport, uint32_t width,
+                                     uint32_t height, PixelFormat format) {
+    if (format != mFormat) {
+        return INVALID_OPERATION;
+    }
+
+    mWidth = width;
+    mHeight = height;
+
+    updateSourceRect(info, viewport);
+
+    Rect displayRect = getDisplayRect();
+
+    status_t err = mCpuConsumer->setDefaultBufferSize(width, height);
+    if (err != NO_ERROR) {
+        ALOGE("Failed to resize virtual display buffers: %d", err);
+        return err;
+    }
+
+    SurfaceComposerClient::openGlobalTransaction();
+    SurfaceComposerClient::setDisplaySize(mDpy, width, height);
+    SurfaceComposerClient::setDisplayProjection(mDpy, 0, mSourceRect, displayRect);
+    SurfaceComposerClient::closeGlobalTransaction();
+
+    ALOGV("Virtual display reconfigured (%ux%u [viewport=%ux%u])", width, height,
+          displayRect.getWidth(), displayRect.getHeight());
+
+    return NO_ERROR;
+}
+
+void VirtualDisplay::setPaused(bool paused) {
+    if (paused == mPaused) {
+        return;
+    }
+    mPaused = paused;
+
+    // a display without a surface is not composited at all
+    SurfaceComposerClient::openGlobalTransaction();
+    SurfaceComposerClient::setDisplaySurface(mDpy, paused ? nullptr : mProducer);
+    SurfaceComposerClient::closeGlobalTransaction();
+
+    ALOGV("Virtual display %s", paused ? "paused" : "resumed");
+}
+
+void VirtualDisplay::discardQueuedBuffers() {
+    CpuConsumer::LockedBuffer buffer;
+    int count = 0;
+    while (mCpuConsumer->lockNextBuffer(&buffer) == NO_ERROR) {
+        mCpuConsumer->unlockBuffer(buffer);
+        count++;
+    }
+    ALOGV("Discarded %d queued buffers", count);
+}
+
+void VirtualDisplay::updateSourceRect(DisplayInfo* info, const Rect& viewport) {
+    if (info->orientation == DISPLAY_ORIENTATION_0 ||
+        info->orientation == DISPLAY_ORIENTATION_180) {
+        mScreenRect = Rect(info->w, info->h);
+    } else {
+        mScreenRect = Rect(info->h, info->w);
+    }
+
+    // only the viewport is composited, so the buffers and everything
+    // after them scale with its size
+    mSourceRect = mScreenRect;
+    if (!viewport.isEmpty() && !mScreenRect.intersect(viewport, &mSourceRect)) {
+        mSourceRect = mScreenRect;
+    }
+}
+
 Rect VirtualDisplay::getDisplayRect() {
     uint32_t outWidth, outHeight;
     if (mWidth > (uint32_t)((float)mWidth * aspectRatio())) {
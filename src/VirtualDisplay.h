@@ -24,6 +24,7 @@
 #include <gui/IGraphicBufferProducer.h>
 
 #include <ui/DisplayInfo.h>
+#include <ui/PixelFormat.h>
 #include <ui/Rect.h>
 
 using namespace android;
@@ -32,22 +33,61 @@ namespace vncflinger {
 
 class VirtualDisplay : public RefBase {
   public:
-    VirtualDisplay(DisplayInfo* info, uint32_t width, uint32_t height,
+    // viewport is the part of the display to capture in its current
+    // orientation, an empty rect captures all of it. layerStack picks
+    // the content, it is the one of the display being mirrored.
+    VirtualDisplay(DisplayInfo* info, const Rect& viewport, uint32_t width, uint32_t height,
+                   PixelFormat format, uint32_t layerStack,
                    sp<CpuConsumer::FrameAvailableListener> listener);
 
     virtual ~VirtualDisplay();
 
+    // change the geometry of the existing display and queue, buffers of
+    // the old size are replaced as they are dequeued. surfaceflinger keeps
+    // the output format it picked at creation, so a new format fails with
+    // INVALID_OPERATION and needs a new display.
+    virtual status_t reconfigure(DisplayInfo* info, const Rect& viewport, uint32_t width,
+                                 uint32_t height, PixelFormat format);
+
     virtual Rect getDisplayRect();
 
+    // area of the display which is captured
     virtual Rect getSourceRect() {
         return mSourceRect;
     }
 
+    // the whole display in its current orientation
+    virtual Rect getScreenRect() {
+        return mScreenRect;
+    }
+
+    // format requested from the gpu
+    PixelFormat getFormat() {
+        return mFormat;
+    }
+
     CpuConsumer* getConsumer() {
         return mCpuConsumer.get();
     }
 
+    // stop or resume compositing into the display without destroying it
+    void setPaused(bool paused);
+
+    bool isPaused() {
+        return mPaused;
+    }
+
+    // release everything in the queue, only while nothing captures from it
+    void discardQueuedBuffers();
+
+    // buffers which can be locked at the same time
+    int getMaxAcquiredBuffers() {
+        return mMaxAcquiredBuffers;
+    }
+
   private:
+    void updateSourceRect(DisplayInfo* info, const Rect& viewport);
+
     float aspectRatio() {
         return (float)mSourceRect.getHeight() / (float)mSourceRect.getWidth();
     }
@@ -55,6 +95,9 @@ class VirtualDisplay : public RefBase {
     // Producer side of queue, passed into the virtual display.
     sp<IGraphicBufferProducer> mProducer;
 
+    // Consumer side of queue
+    sp<IGraphicBufferConsumer> mConsumer;
+
     // This receives frames from the virtual display and makes them available
     sp<CpuConsumer> mCpuConsumer;
 
@@ -63,8 +106,16 @@ class VirtualDisplay : public RefBase {
 
     sp<CpuConsumer::FrameAvailableListener> mListener;
 
+    int mMaxAcquiredBuffers;
+
+    PixelFormat mFormat;
+
+    // detached from its surface, surfaceflinger skips it
+    bool mPaused;
+
     uint32_t mWidth, mHeight;
     Rect mSourceRect;
+    Rect mScreenRect;
 };
 };
 #endif
@@ -0,0 +1,128 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "WorkerPool"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+
+#include "WorkerPool.h"
+
+using namespace vncflinger;
+
+WorkerPool::WorkerPool(int threads, uint32_t affinity)
+    : mAffinity(affinity), mFn(nullptr), mNextJob(0), mJobs(0), mRunning(0), mExit(false) {
+    for (int i = 1; i < threads; i++) {
+        sp<Worker> worker = new Worker(this);
+        if (worker->run("VNC-Worker") != NO_ERROR) {
+            ALOGE("Failed to start worker thread");
+            break;
+        }
+        mWorkers.push_back(worker);
+    }
+
+    ALOGV("Worker pool started with %zu threads", mWorkers.size() + 1);
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        Mutex::Autolock _l(mLock);
+        mExit = true;
+        for (const auto& worker : mWorkers) {
+            worker->requestExit();
+        }
+        mWorkAvailable.broadcast();
+    }
+
+    for (const auto& worker : mWorkers) {
+        worker->join();
+    }
+}
+
+void WorkerPool::runJobsLocked() {
+    while (mNextJob < mJobs) {
+        int job = mNextJob++;
+        mRunning++;
+
+        mLock.unlock();
+        (*mFn)(job);
+        mLock.lock();
+
+        if (--mRunning == 0 && mNextJob >= mJobs) {
+            mWorkDone.broadcast();
+        }
+    }
+}
+
+void WorkerPool::run(int jobs, const std::function<void(int)>& fn) {
+    Mutex::Autolock _l(mLock);
+
+    mFn = &fn;
+    mNextJob = 0;
+    mJobs = jobs;
+
+    if (jobs > 1 && !mWorkers.empty()) {
+        mWorkAvailable.broadcast();
+    }
+
+    // the caller works too instead of just waiting
+    runJobsLocked();
+
+    while (mRunning > 0) {
+        mWorkDone.wait(mLock);
+    }
+
+    mFn = nullptr;
+    mJobs = 0;
+}
+
+bool WorkerPool::workerLoop() {
+    Mutex::Autolock _l(mLock);
+
+    while (!mExit && mNextJob >= mJobs) {
+        mWorkAvailable.wait(mLock);
+    }
+
+    if (mExit) {
+        return false;
+    }
+
+    runJobsLocked();
+    return true;
+}
+
+status_t WorkerPool::Worker::readyToRun() {
+    if (mPool->mAffinity != 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < 32; cpu++) {
+            if (mPool->mAffinity & (1u << cpu)) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            ALOGW("Failed to set worker affinity to %x: %s", mPool->mAffinity, strerror(errno));
+        }
+    }
+    return NO_ERROR;
+}
+
+bool WorkerPool::Worker::threadLoop() {
+    return mPool->workerLoop();
+}
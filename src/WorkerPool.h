@@ -0,0 +1,83 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <functional>
+#include <vector>
+
+#include <utils/Condition.h>
+#include <utils/Mutex.h>
+#include <utils/RefBase.h>
+#include <utils/Thread.h>
+
+using namespace android;
+
+namespace vncflinger {
+
+// Small fixed set of threads which split independent jobs with the
+// caller. Workers sleep on a condition between batches.
+class WorkerPool : public RefBase {
+  public:
+    // threads is the total including the caller, affinity is a
+    // cpu mask for the workers (0 for no restriction)
+    WorkerPool(int threads, uint32_t affinity);
+
+    virtual ~WorkerPool();
+
+    int getThreads() const {
+        return (int)mWorkers.size() + 1;
+    }
+
+    // runs fn(0) .. fn(jobs - 1) and waits for all of them
+    void run(int jobs, const std::function<void(int)>& fn);
+
+  private:
+    class Worker : public Thread {
+      public:
+        Worker(WorkerPool* pool) : Thread(false), mPool(pool) {
+        }
+
+      private:
+        virtual status_t readyToRun();
+        virtual bool threadLoop();
+
+        WorkerPool* mPool;
+    };
+
+    // take and run jobs until there are none left, called with mLock held
+    void runJobsLocked();
+
+    bool workerLoop();
+
+    std::vector<sp<Worker>> mWorkers;
+
+    uint32_t mAffinity;
+
+    Mutex mLock;
+    Condition mWorkAvailable;
+    Condition mWorkDone;
+
+    const std::function<void(int)>* mFn;
+    int mNextJob, mJobs, mRunning;
+
+    bool mExit;
+};
+};
+
+#endif
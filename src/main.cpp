@@ -1,11 +1,20 @@
 #define LOG_TAG "VNCFlinger"
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
 #include <utils/Log.h>
+#include <utils/Trace.h>
 
 #include <fcntl.h>
 #include <inttypes.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <map>
 
 #include "AndroidDesktop.h"
 #include "AndroidSocket.h"
+#include "FramePacer.h"
+#include "PerfStats.h"
+#include "VNCService.h"
 
 #include <binder/IPCThreadState.h>
 #include <binder/IServiceManager.h>
@@ -20,6 +29,7 @@
 #include <rfb/util.h>
 
 #include <cutils/properties.h>
+#include <cutils/sockets.h>
 
 
 using namespace vncflinger;
@@ -37,6 +47,56 @@ static rfb::IntParameter rfbport("rfbport", "TCP port to listen for RFB protocol
 static rfb::BoolParameter localhostOnly("localhost", "Only allow connections from localhost", false);
 static rfb::StringParameter rfbunixpath("rfbunixpath", "Unix socket to listen for RFB protocol", "");
 static rfb::IntParameter rfbunixmode("rfbunixmode", "Unix socket access mode", 0600);
+static rfb::IntParameter sendBuffer(
+    "sendbuffer", "Socket send buffer size in bytes, 0 for the system default", 0);
+
+static const int kMaxEvents = 32;
+
+struct ClientState {
+    network::Socket* sock;
+    bool writing;
+
+    // write position of the output stream, its int length wraps after
+    // 2 GiB so only unsigned differences of it are used
+    uint32_t position;
+
+    // bytes handed to the socket so far
+    uint64_t sent;
+};
+
+static void addEpollFd(int epollFd, int fd, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        throw rdr::SystemException("epoll_ctl", errno);
+    }
+}
+
+static void modifyEpollFd(int epollFd, int fd, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        throw rdr::SystemException("epoll_ctl", errno);
+    }
+}
+
+// write a stats snapshot to whoever connected to the control socket
+static void dumpStats(int statsFd) {
+    int fd = accept4(statsFd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    std::string stats = PerfStats::get().dump();
+    if (send(fd, stats.data(), stats.size(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        ALOGW("Failed to write stats: %s", strerror(errno));
+    }
+    close(fd);
+}
 
 static void printVersion(FILE* fp) {
     fprintf(fp, "VNCFlinger 1.0");
@@ -95,12 +155,28 @@ int main(int argc, char** argv) {
 
     std::list<network::SocketListener*> listeners;
 
+    // init sockets and the binder service are named after the unix socket,
+    // so one instance can run for each display
+    std::string instanceName = "vncflinger";
+    const char* unixPath = rfbunixpath;
+    if (unixPath[0] != '\0') {
+        const char* slash = strrchr(unixPath, '/');
+        instanceName = slash != NULL ? slash + 1 : unixPath;
+    }
+
     try {
         sp<AndroidDesktop> desktop = new AndroidDesktop();
         rfb::VNCServerST server(desktopName.c_str(), desktop.get());
 
-        if (rfbunixpath.getValueStr()[0] != '\0') {
-            listeners.push_back(new AndroidListener("vncflinger"));
+        // runtime tuning, the server still works if this isn't allowed
+        status_t err = defaultServiceManager()->addService(String16(instanceName.c_str()),
+                                                           new VNCService(desktop));
+        if (err != NO_ERROR) {
+            ALOGW("Failed to register the binder service: %d", err);
+        }
+
+        if (unixPath[0] != '\0') {
+            listeners.push_back(new AndroidListener(instanceName.c_str()));
             ALOGI("Listening on %s (mode %04o)", (const char*)rfbunixpath, (int)rfbunixmode);
         } else {
             if (localhostOnly) {
@@ -114,91 +190,174 @@ int main(int argc, char** argv) {
         int eventFd = desktop->getEventFd();
         fcntl(eventFd, F_SETFL, O_NONBLOCK);
 
+        FramePacer* pacer = desktop->getFramePacer();
+
+        int epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0) {
+            throw rdr::SystemException("epoll_create1", errno);
+        }
+
+        // the eventfd is drained on every wakeup, so edge triggering is enough
+        addEpollFd(epollFd, eventFd, EPOLLIN | EPOLLET);
+
+        std::map<int, network::SocketListener*> listenerFds;
+        for (std::list<network::SocketListener*>::iterator i = listeners.begin();
+             i != listeners.end(); i++) {
+            addEpollFd(epollFd, (*i)->getFd(), EPOLLIN);
+            listenerFds[(*i)->getFd()] = *i;
+        }
+
+        // optional, only if the init script created it
+        int statsFd = android_get_control_socket((instanceName + "-stats").c_str());
+        if (statsFd >= 0) {
+            if (listen(statsFd, 4) < 0) {
+                throw rdr::SystemException("listen", errno);
+            }
+            addEpollFd(epollFd, statsFd, EPOLLIN);
+        }
+
+        // registered clients, and whether they are waiting for EPOLLOUT
+        std::map<int, ClientState> clients;
+
         while (!gCaughtSignal) {
             int wait_ms;
-            struct timeval tv;
-            fd_set rfds, wfds;
+            struct epoll_event events[kMaxEvents];
             std::list<network::Socket*> sockets;
             std::list<network::Socket*>::iterator i;
 
-            FD_ZERO(&rfds);
-            FD_ZERO(&wfds);
-
-            FD_SET(eventFd, &rfds);
-            for (std::list<network::SocketListener*>::iterator i = listeners.begin();
-                 i != listeners.end(); i++)
-                FD_SET((*i)->getFd(), &rfds);
-
+            // single pass over the clients: reap closed ones, register new
+            // ones and follow changes in their output backlog
             server.getSockets(&sockets);
-            int clients_connected = 0;
             for (i = sockets.begin(); i != sockets.end(); i++) {
+                int fd = (*i)->getFd();
                 if ((*i)->isShutdown()) {
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+                    clients.erase(fd);
+                    pacer->removeClient(*i);
+                    PerfStats::get().removeClient(fd);
                     server.removeSocket(*i);
                     delete (*i);
+                    continue;
+                }
+
+                int backlog = (*i)->outStream().bufferUsage();
+                uint32_t position = (uint32_t)(*i)->outStream().length() - (uint32_t)backlog;
+                bool writing = backlog > 0;
+
+                std::map<int, ClientState>::iterator client = clients.find(fd);
+                if (client == clients.end() || client->second.sock != *i) {
+                    addEpollFd(epollFd, fd, EPOLLIN | (writing ? EPOLLOUT : 0));
+                    clients[fd] = ClientState{*i, writing, position, position};
+                    client = clients.find(fd);
+                    PerfStats::get().add(PerfStats::BYTES_SENT, position);
                 } else {
-                    FD_SET((*i)->getFd(), &rfds);
-                    if ((*i)->outStream().bufferUsage() > 0) {
-                        FD_SET((*i)->getFd(), &wfds);
+                    uint32_t delta = position - client->second.position;
+                    client->second.position = position;
+                    client->second.sent += delta;
+                    PerfStats::get().add(PerfStats::BYTES_SENT, delta);
+
+                    if (client->second.writing != writing) {
+                        modifyEpollFd(epollFd, fd, EPOLLIN | (writing ? EPOLLOUT : 0));
+                        client->second.writing = writing;
                     }
-                    clients_connected++;
                 }
+
+                pacer->setClientBacklog(*i, backlog, client->second.sent);
+                PerfStats::get().setClientBytes(fd, client->second.sent);
             }
 
             wait_ms = 0;
 
-            rfb::soonestTimeout(&wait_ms, rfb::Timer::checkTimeouts());
-
-            tv.tv_sec = wait_ms / 1000;
-            tv.tv_usec = (wait_ms % 1000) * 1000;
+            {
+                PerfStats::ScopedTimer timer(PerfStats::TIMERS);
+                rfb::soonestTimeout(&wait_ms, rfb::Timer::checkTimeouts());
+            }
 
-            int n = select(FD_SETSIZE, &rfds, &wfds, 0, wait_ms ? &tv : NULL);
+            int n = epoll_wait(epollFd, events, kMaxEvents, wait_ms ? wait_ms : -1);
 
             if (n < 0) {
                 if (errno == EINTR) {
-                    ALOGV("Interrupted select() system call");
+                    ALOGV("Interrupted epoll_wait() system call");
                     continue;
                 } else {
-                    throw rdr::SystemException("select", errno);
+                    throw rdr::SystemException("epoll_wait", errno);
                 }
             }
 
-            // Accept new VNC connections
-            for (std::list<network::SocketListener*>::iterator i = listeners.begin();
-                 i != listeners.end(); i++) {
-                if (FD_ISSET((*i)->getFd(), &rfds)) {
-                    network::Socket* sock = (*i)->accept();
+            ATRACE_NAME("dispatch");
+
+            bool frameReady = false;
+
+            for (int e = 0; e < n; e++) {
+                int fd = events[e].data.fd;
+                uint32_t ev = events[e].events;
+
+                // Process events from the display
+                if (fd == eventFd) {
+                    uint64_t eventVal;
+                    int status = read(eventFd, &eventVal, sizeof(eventVal));
+                    if (status > 0 && eventVal > 0) {
+                        ALOGV("status=%d eventval=%" PRIu64, status, eventVal);
+                        frameReady = true;
+                    }
+                    continue;
+                }
+
+                if (fd == statsFd) {
+                    dumpStats(statsFd);
+                    continue;
+                }
+
+                // Accept new VNC connections
+                std::map<int, network::SocketListener*>::iterator listener = listenerFds.find(fd);
+                if (listener != listenerFds.end()) {
+                    network::Socket* sock = listener->second->accept();
                     if (sock) {
+                        // a larger kernel buffer takes a whole update in fewer writes
+                        // and fewer EPOLLOUT wakeups
+                        int size = sendBuffer;
+                        if (size > 0 && setsockopt(sock->getFd(), SOL_SOCKET, SO_SNDBUF, &size,
+                                                   sizeof(size)) < 0) {
+                            ALOGW("Failed to set send buffer: %s", strerror(errno));
+                        }
                         sock->outStream().setBlocking(false);
                         server.addSocket(sock);
                     } else {
                         ALOGW("Client connection rejected");
                     }
+                    continue;
                 }
-            }
-
-            rfb::Timer::checkTimeouts();
-
-            // Client list could have been changed.
-            server.getSockets(&sockets);
 
-            // Nothing more to do if there are no client connections.
-            if (sockets.empty()) continue;
+                // Process events on existing VNC connections
+                std::map<int, ClientState>::iterator client = clients.find(fd);
+                if (client == clients.end() || client->second.sock->isShutdown()) {
+                    continue;
+                }
+                if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    server.processSocketReadEvent(client->second.sock);
+                }
+                if ((ev & EPOLLOUT) && !client->second.sock->isShutdown()) {
+                    PerfStats::ScopedTimer timer(PerfStats::BACKLOG_FLUSH);
+                    server.processSocketWriteEvent(client->second.sock);
+                }
+            }
 
-            // Process events on existing VNC connections
-            for (i = sockets.begin(); i != sockets.end(); i++) {
-                if (FD_ISSET((*i)->getFd(), &rfds)) server.processSocketReadEvent(*i);
-                if (FD_ISSET((*i)->getFd(), &wfds)) server.processSocketWriteEvent(*i);
+            {
+                // framebuffer updates are encoded from the server's timers,
+                // which share the list with the desktop's own
+                PerfStats::ScopedTimer timer(PerfStats::TIMERS);
+                rfb::Timer::checkTimeouts();
             }
 
-            // Process events from the display
-            uint64_t eventVal;
-            int status = read(eventFd, &eventVal, sizeof(eventVal));
-            if (status > 0 && eventVal > 0) {
-                ALOGV("status=%d eventval=%" PRIu64, status, eventVal);
+            if (frameReady) {
                 desktop->processFrames();
             }
+        }
 
+        if (statsFd >= 0) {
+            close(statsFd);
         }
+        close(epollFd);
 
     } catch (rdr::Exception& e) {
         ALOGE("%s", e.str());